@@ -1,5 +1,15 @@
 import arbor
-from typing import Tuple, List, Union, Literal, NamedTuple, Type
+import atexit
+import ctypes
+import importlib.machinery
+import importlib.util
+import os
+import shutil
+import sys
+import tempfile
+import weakref
+import numpy as np
+from typing import Tuple, List, Union, Literal, NamedTuple, Type, Dict, Any, Callable
 import arbor_pycat._core as acm
 
 class IonInfo(NamedTuple):
@@ -13,6 +23,16 @@ class IonInfo(NamedTuple):
     verify_valence: bool = False
     expected_valence: int = 1
 
+class Gate(NamedTuple):
+    name: str        # state variable holding the gate
+    alpha: Callable  # alpha(v) -> rate, called once on a numpy array of voltages
+    beta: Callable
+
+class Current(NamedTuple):
+    gbar: str                    # parameter name, S/cm2
+    erev: str                    # parameter name, mV
+    powers: Dict[str, int] = {}  # gate name -> exponent
+
 class CustomMechanism:
     name: str
     globals: Union[List[Tuple[str, str, float]], Tuple[()]] = ()
@@ -21,6 +41,32 @@ class CustomMechanism:
     random: Union[List[Tuple[str, int]], Tuple[()]] = ()
     ions: Union[List[IonInfo], Tuple[()]] = ()
     kind: Literal['density', 'point'] = 'density'
+    # post_event is only called when set
+    has_post_events: bool = False
+    # callback name -> C function taking arb_mechanism_ppack*, see native_address
+    native: Dict[str, Any] = {}
+    # fused: call step() once per timestep instead of advance_state,
+    # compute_currents and write_ions
+    fused: bool = False
+    # SIMD layout asked from arbor: rows padded to a multiple of
+    # partition_width, aligned to alignment bytes. See pp.padded_width
+    partition_width: int = 1
+    alignment: int = 8
+    # call python only every update_every steps, advance_state then sees
+    # pp.dt * update_every. In between, the last currents, conductances and
+    # ion writes are reapplied natively. With extrapolate, the state change
+    # is spread linearly over the skipped steps
+    update_every: int = 1
+    extrapolate: bool = False
+    # hand python float32 copies: state and parameter attributes, v_local,
+    # i_local and g_local become single precision. State changes and the
+    # currents added to i_local/g_local are accumulated back in double.
+    # Parameters are read-only in this mode
+    float32: bool = False
+    # outputs of these callbacks ('compute_currents', 'write_ions') are
+    # recorded after a python call and reapplied natively on later steps,
+    # until marked dirty with pp.mark_dirty() or arbor_pycat.mark_dirty()
+    constant: Tuple[str, ...] = ()
 
     def init_mechanism(self, pp):
         pass
@@ -34,6 +80,33 @@ class CustomMechanism:
     def write_ions(self, pp):
         pass
 
+    def apply_events(self, pp, events):
+        '''Point mechanisms only, called in steps that deliver events. events
+        is a read-only structured array with fields mech_index and weight'''
+        pass
+
+    def post_event(self, pp):
+        '''Called after a spike when has_post_events is set, see
+        pp.time_since_spike'''
+        pass
+
+    def step(self, pp):
+        '''Fused mode only: advance the state by pp.dt and return a dict with
+        any of 'state' [n_state, width], 'i', 'g' [width] and 'ion_i', 'ion_g',
+        'ion_xi', 'ion_xo', 'ion_erev' [n_ions, width]. Currents are added in
+        the next compute_currents, ion values written in write_ions.'''
+        pass
+
+class RateMechanism(CustomMechanism):
+    '''Gates whose rates only depend on v. The rate functions are tabulated
+    over vrange once when the catalogue is built; after that the mechanism
+    runs natively (cnexp update, g = gbar * prod(gate**power)) and no python
+    callbacks are made'''
+    gates: Union[List[Gate], Tuple[()]] = ()
+    currents: Union[List[Current], Tuple[()]] = ()
+    vrange: Tuple[float, float] = (-150., 150.)
+    resolution: float = 0.01 # mV
+
 class PointerPack:
     def __init__(self, pp):
         self.pp = pp
@@ -43,12 +116,76 @@ class PointerPack:
         self.width = pp.width
         return self
 
-def register(Mech: Type[CustomMechanism]):
+# ctypes/numba objects backing native kernels must outlive the catalogue
+_native_keepalive = []
+
+def native_address(kernel):
+    '''Address of a C function `void(arb_mechanism_ppack*)`: accepts a plain
+    int, a numba cfunc (or anything with .address) or a ctypes function'''
+    if isinstance(kernel, int):
+        return kernel
+    if hasattr(kernel, 'address'):
+        return kernel.address
+    return ctypes.cast(kernel, ctypes.c_void_p).value
+
+_core_copies: List[str] = []
+# every loaded copy of the extension module, the original first
+_cores: List[Any] = [acm]
+
+def _load_core_copy():
+    '''Import a private copy of the extension module. dlopen maps a file only
+    once, so each copy has its own mechanism list and frozen flag, and arbor
+    loads it as an unrelated catalogue'''
+    if not _core_copies:
+        _core_copies.append(tempfile.mkdtemp(prefix='arbor_pycat_'))
+        # the copies stay mapped, removing the files is fine
+        atexit.register(shutil.rmtree, _core_copies[0], True)
+    name = f'arbor_pycat._registry{len(_core_copies)}._core'
+    path = os.path.join(_core_copies[0], f'_core{len(_core_copies)}.so')
+    _core_copies.append(path)
+    shutil.copyfile(acm.get_so_name(), path)
+    loader = importlib.machinery.ExtensionFileLoader(name, path)
+    spec = importlib.util.spec_from_file_location(name, path, loader=loader)
+    core = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(core)
+    # like the original, kept alive until exit: arbor may still call into it
+    # after the Registry is gone
+    sys.modules[name] = core
+    _cores.append(core)
+    return core
+
+class Registry:
+    '''A set of mechanisms that becomes one catalogue. Registries are
+    independent: each can be built once, while others are still being
+    filled, so a long-lived process can build a catalogue per variant
+    instead of restarting. The module level register/build/record use
+    default_registry'''
+    def __init__(self, core=None):
+        # core: the extension module holding the mechanisms, a fresh copy
+        # of arbor_pycat._core by default
+        self.core = core if core is not None else _load_core_copy()
+        # name -> (ArbMech, {field name: (kind, index)}) for record()
+        self.registered: Dict[str, Any] = {}
+    def register(self, Mech: Type[CustomMechanism]):
+        return register(Mech, self)
+    def build(self):
+        return build(self)
+    def record(self, mech_name: str, fields: List[str], path: str, every: int = 1,
+               cvs: Union[List[int], None] = None, capacity: int = 4096):
+        return record(mech_name, fields, path, every, cvs, capacity, self)
+    def mark_dirty(self, mech_name: str):
+        return mark_dirty(mech_name, self)
+
+def register(Mech: Type[CustomMechanism], registry: Union[Registry, None] = None):
     # Mech = dataclass(frozen=True)(Mech)
+    registry = registry or default_registry
     mech = Mech()
-    arb_mech = acm.ArbMech();
+    arb_mech = registry.core.ArbMech();
     def setter(arr, val):
         arr[:] = val
+    def local_setter(arr, val):
+        if val is not arr: # pp.i_local += x already wrote in place
+            arr[:] = val
     class SubPointerPack(PointerPack):
         @property
         def node_index(self): return self.pp.node_index
@@ -64,20 +201,71 @@ def register(Mech: Type[CustomMechanism]):
         def g(self): return self.pp.g
         @g.setter
         def g(self, g): self.pp.g[:] = g
+        # v/i/g of this mechanism's own CVs: slices when node_index is a
+        # contiguous range, otherwise a native gather/scatter buffer.
+        # Accumulate with +=
+        @property
+        def v_local(self): return self.pp.v_local
+        @v_local.setter
+        def v_local(self, v): local_setter(self.pp.v_local, v)
+        @property
+        def i_local(self): return self.pp.i_local
+        @i_local.setter
+        def i_local(self, i): local_setter(self.pp.i_local, i)
+        @property
+        def g_local(self): return self.pp.g_local
+        @g_local.setter
+        def g_local(self, g): local_setter(self.pp.g_local, g)
+        @property
+        def weight(self): return self.pp.weight
+        @property
+        def cell_index(self): return self.pp.cell_index
+        # cells in this ppack: cell_index[node_index] is in range(n_cells)
+        @property
+        def n_cells(self): return self.pp.n_cells
+        @property
+        def n_detectors(self): return self.pp.n_detectors
+        @property
+        def time_since_spike(self): return self.pp.time_since_spike
+        @property
+        def padded_width(self): return self.pp.padded_width
+        # [n_ions, width] for field in i, g, erev, xi, xo, xd, one row per
+        # entry of Mech.ions. The returned buffer is reused by the next call
+        def gather_ions(self, field): return self.pp.gather_ions(field)
+        def scatter_ions(self, field, val, accumulate=False): self.pp.scatter_ions(field, val, accumulate)
+        # call the constant callbacks from python again on the next step
+        def mark_dirty(self): self.pp.mark_dirty()
 
+    if Mech.float32:
+        for name, attr in [('v_local', 'v32'), ('i_local', 'i32'), ('g_local', 'g32')]:
+            f = property(lambda self, attr=attr: getattr(self.pp, attr))
+            f = f.setter(lambda self, val, attr=attr: local_setter(getattr(self.pp, attr), val))
+            setattr(SubPointerPack, name, f)
     for name, unit, defaultval in Mech.globals:
         idx = arb_mech.add_global(name, unit, defaultval)
         setattr(SubPointerPack, name, property(lambda self, idx=idx: self.pp.glob(idx)))
-    for name, unit, defaultval in Mech.state_vars:
+    gates = getattr(Mech, 'gates', ())
+    state_idx = {}
+    param_idx = {}
+    for name, unit, defaultval in [*Mech.state_vars, *[(g.name, '', 0.) for g in gates]]:
         idx = arb_mech.add_state(name, unit, defaultval)
+        state_idx[name] = idx
         f = property(lambda self, idx=idx: self.pp.state(idx))
         f = f.setter(lambda self, val, idx=idx: setter(self.pp.state(idx), val))
+        if Mech.float32:
+            f = property(lambda self, idx=idx: self.pp.state32(idx))
+            f = f.setter(lambda self, val, idx=idx: setter(self.pp.state32(idx), val))
         setattr(SubPointerPack, name, f)
+        setattr(SubPointerPack, f'{name}_padded', property(lambda self, idx=idx: self.pp.state_padded(idx)))
     for name, unit, defaultval in Mech.parameters:
         idx = arb_mech.add_parameter(name, unit, defaultval)
+        param_idx[name] = idx
         f = property(lambda self, idx=idx: self.pp.param(idx))
         f = f.setter(lambda self, val, idx=idx: setter(self.pp.param(idx), val))
+        if Mech.float32:
+            f = property(lambda self, idx=idx: self.pp.param32(idx))
         setattr(SubPointerPack, name, f)
+        setattr(SubPointerPack, f'{name}_padded', property(lambda self, idx=idx: self.pp.param_padded(idx)))
     for name, index in Mech.random:
         idx = arb_mech.add_random(name, index)
         assert idx == index # sorry I have no idea what the differences are
@@ -93,15 +281,170 @@ def register(Mech: Type[CustomMechanism]):
         setattr(SubPointerPack, f'{ioninfo.name}d', property(lambda self, idx=idx: self.pp.ions(idx).diffusive_concentration).setter(lambda self, val, idx=idx: setter(self.pp.ions(idx).diffusive_concentration, val)))
         setattr(SubPointerPack, f'{ioninfo.name}q', property(lambda self, idx=idx: self.pp.ions(idx).ionic_charge))
         setattr(SubPointerPack, f'index_{ioninfo.name}', property(lambda self, idx=idx: self.pp.ions(idx).index))
+    if issubclass(Mech, RateMechanism):
+        vmin, vmax = Mech.vrange
+        arb_mech.set_rate_range(vmin, vmax, int(round((vmax - vmin) / Mech.resolution)) + 1)
+        for gate in gates:
+            arb_mech.add_rate_gate(state_idx[gate.name], gate.alpha, gate.beta)
+        for current in Mech.currents:
+            powers = [(state_idx[name], power) for name, power in current.powers.items()]
+            arb_mech.add_rate_current(param_idx[current.gbar], param_idx[current.erev], powers)
     spp = SubPointerPack(None)
     arb_mech.set_init(lambda pp: mech.init_mechanism(spp._set(pp)))
     arb_mech.set_advance_state(lambda pp: mech.advance_state(spp._set(pp)))
     arb_mech.set_compute_currents(lambda pp: mech.compute_currents(spp._set(pp)))
     arb_mech.set_write_ions(lambda pp: mech.write_ions(spp._set(pp)))
+    if Mech.kind == 'point':
+        arb_mech.set_kind_point()
+    arb_mech.set_partition_width(Mech.partition_width)
+    arb_mech.set_alignment(Mech.alignment)
+    if Mech.float32:
+        arb_mech.set_float32(True)
+    if Mech.update_every != 1 or Mech.extrapolate:
+        arb_mech.set_update_every(Mech.update_every, Mech.extrapolate)
+    if Mech.constant:
+        assert set(Mech.constant) <= {'compute_currents', 'write_ions'}, Mech.constant
+        arb_mech.set_constant('compute_currents' in Mech.constant, 'write_ions' in Mech.constant)
+    if Mech.apply_events is not CustomMechanism.apply_events:
+        arb_mech.set_apply_events(lambda pp, events: mech.apply_events(spp._set(pp), events))
+    if Mech.has_post_events:
+        arb_mech.set_has_post_events(True)
+        arb_mech.set_post_event(lambda pp: mech.post_event(spp._set(pp)))
+    if Mech.fused:
+        arb_mech.set_step(lambda pp: mech.step(spp._set(pp)))
+    for callback, kernel in Mech.native.items():
+        set_native = {'init_mechanism': arb_mech.set_init_native,
+                  'advance_state': arb_mech.set_advance_state_native,
+                  'compute_currents': arb_mech.set_compute_currents_native,
+                  'write_ions': arb_mech.set_write_ions_native,
+                  'apply_events': arb_mech.set_apply_events_native,
+                  'post_event': arb_mech.set_post_event_native}[callback]
+        set_native(native_address(kernel))
+        _native_keepalive.append(kernel)
     arb_mech.set_name(mech.name)
-    acm.register(arb_mech)
+    registry.core.register(arb_mech)
+    fields = {'v': ('v', 0), 'i': ('i', 0), 'g': ('g', 0)}
+    fields.update({name: ('state', idx) for name, idx in state_idx.items()})
+    for idx, ioninfo in enumerate(Mech.ions):
+        ion = ioninfo.name
+        fields.update({f'i{ion}': ('ion_i', idx), f'c{ion}': ('ion_g', idx), f'e{ion}': ('ion_erev', idx),
+                       f'{ion}i': ('ion_xi', idx), f'{ion}o': ('ion_xo', idx), f'{ion}d': ('ion_xd', idx)})
+    registry.registered[mech.name] = (arb_mech, fields)
+
+class Recording:
+    def __init__(self, arb_mech, path, fields):
+        self.arb_mech = arb_mech
+        self.path = path
+        self.fields = fields
+    def stop(self):
+        '''Flush all buffers and close the file'''
+        self.arb_mech.stop_recording()
+    def read(self):
+        return read_recording(self.path)
+    def layout(self):
+        return read_recording_layout(self.path)
+
+def record(mech_name: str, fields: List[str], path: str, every: int = 1,
+           cvs: Union[List[int], None] = None, capacity: int = 4096,
+           registry: Union[Registry, None] = None):
+    '''Sample `fields` (state names, v, i, g, ica, cai, ...) of every
+    instance (or those on `cvs`, CV indices local to each cell group) each
+    `every` steps after advance_state.
+    Samples are buffered natively and written to `path` by a background
+    thread; python only sees them through read() after stop()'''
+    arb_mech, known = (registry or default_registry).registered[mech_name]
+    arb_mech.start_recording(path, [known[f] for f in fields], every, list(cvs or []), capacity)
+    return Recording(arb_mech, path, fields)
+
+def mark_dirty(mech_name: str, registry: Union[Registry, None] = None):
+    '''Call the constant callbacks of mech_name from python again on the
+    next step, on every instance. Use between runs, e.g. after changing
+    something the outputs depend on'''
+    arb_mech, _ = (registry or default_registry).registered[mech_name]
+    arb_mech.mark_dirty()
 
-def build():
-    so_name = acm.get_so_name()
+_recording_header = 0x80000000
+
+def _recording_frames(path: str):
+    '''(stream, is_header, [rows, cols]) for every frame in the file'''
+    raw = np.fromfile(path, dtype=np.uint8)
+    pos = 0
+    while pos < len(raw):
+        stream, cols = raw[pos:pos+8].view(np.uint32)
+        rows, = raw[pos+8:pos+16].view(np.uint64)
+        pos += 16
+        n = int(rows) * int(cols) * 8
+        data = raw[pos:pos+n].view(np.float64).reshape(int(rows), int(cols))
+        pos += n
+        yield int(stream) & ~_recording_header, bool(stream & _recording_header), data
+
+def read_recording(path: str) -> Dict[int, np.ndarray]:
+    '''{stream: [n_samples, 1 + n_fields*n_instances]}, one stream per ppack
+    (cell group) and init. Column 0 is the step, then each field for all instances;
+    see read_recording_layout for which instances'''
+    chunks: Dict[int, List[np.ndarray]] = {}
+    for stream, is_header, data in _recording_frames(path):
+        chunks.setdefault(stream, [])
+        if not is_header:
+            chunks[stream].append(data)
+    return {stream: np.concatenate(parts) if parts else np.zeros((0, 0)) for stream, parts in chunks.items()}
+
+def read_recording_layout(path: str) -> Dict[int, np.ndarray]:
+    '''{stream: [n_instances]} of ('cv', 'cell'), the recorded instances of
+    each stream in column order. Both are local to the stream's cell group:
+    cv is the group's CV index, cell the index into the group's gids'''
+    layout: Dict[int, np.ndarray] = {}
+    for stream, is_header, data in _recording_frames(path):
+        if is_header:
+            res = np.zeros(data.shape[1], dtype=[('cv', np.int64), ('cell', np.int64)])
+            res['cv'], res['cell'] = data[0], data[1]
+            layout[stream] = res
+    return layout
+
+def batched_decomposition(recipe, context, cells_per_group: Union[int, None] = None):
+    '''Domain decomposition that puts many cable cells in one cell group.
+    Arbor then hands each mechanism all their CVs in a single ppack, so a
+    python mechanism is called once per group and step instead of once per
+    cell. By default there is one group per thread, keeping all threads busy'''
+    if cells_per_group is None:
+        cells_per_group = max(1, -(-recipe.num_cells() // context.threads))
+    hint = {arbor.cell_kind.cable: arbor.partition_hint(cpu_group_size=cells_per_group)}
+    return arbor.partition_load_balance(recipe, context, hint)
+
+def _drop_rounds(rounds):
+    for core, round in rounds:
+        core.drop_round(round)
+
+class simulation(arbor.simulation):
+    '''arbor.simulation whose mechanism instances arbor_pycat tells apart
+    from those of other simulations, and forgets once it is deleted.
+    save_checkpoint only saves instances of these'''
+    def __init__(self, *args, **kwargs):
+        self._rounds = self._init(lambda: arbor.simulation.__init__(self, *args, **kwargs))
+        weakref.finalize(self, _drop_rounds, self._rounds)
+    def reset(self):
+        self._init(lambda: arbor.simulation.reset(self), self._rounds)
+    @staticmethod
+    def _init(fn, rounds=None):
+        new = rounds is None
+        rounds = [(core, core.begin_round_init(round)) for core, round in rounds or [(core, 0) for core in _cores]]
+        try:
+            fn()
+        except BaseException:
+            if new:
+                _drop_rounds(rounds)
+            raise
+        finally:
+            for core, _ in rounds:
+                core.end_round_init()
+        return rounds
+
+def build(registry: Union[Registry, None] = None):
+    from arbor_pycat import codegen
+    registry = registry or default_registry
+    codegen.compile_pending(registry)
+    so_name = registry.core.get_so_name()
     cat = arbor.load_catalogue(so_name)
     return cat
+
+default_registry = Registry(acm)
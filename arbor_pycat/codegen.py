@@ -0,0 +1,263 @@
+'''Compile declarative mechanisms to native kernels.
+
+A declaration is a class with a `state` tuple and the pure array functions
+`init(v)`, `compute_current(v, state)` and `state_gradient(v, state)`, as in
+the de Gruijl example in the README. register() traces these functions with
+symbolic values, emits C++ against the arb_mechanism_ppack ABI and, at
+build() time, compiles it with the system compiler. The shared library is
+cached on disk under the hash of its source, compiler and arbor/ABI
+versions, which also becomes the mechanism fingerprint. Anything the tracer does not understand (python
+control flow on values, unknown functions) falls back to calling the
+declaration from python every step.
+'''
+import ctypes
+import hashlib
+import os
+import subprocess
+import types
+import warnings
+from typing import Dict, List, Any
+
+import numpy as np
+import arbor
+import arbor_pycat
+
+class TracingError(Exception):
+    pass
+
+class Expr:
+    __array_ufunc__ = None # numpy scalars defer to our reflected operators
+    def __init__(self, op, *args):
+        self.op = op
+        self.args = args
+    def __add__(self, o): return Expr('+', self, o)
+    def __radd__(self, o): return Expr('+', o, self)
+    def __sub__(self, o): return Expr('-', self, o)
+    def __rsub__(self, o): return Expr('-', o, self)
+    def __mul__(self, o): return Expr('*', self, o)
+    def __rmul__(self, o): return Expr('*', o, self)
+    def __truediv__(self, o): return Expr('/', self, o)
+    def __rtruediv__(self, o): return Expr('/', o, self)
+    def __pow__(self, o): return Expr('pow', self, o)
+    def __rpow__(self, o): return Expr('pow', o, self)
+    def __neg__(self): return Expr('neg', self)
+    def __pos__(self): return self
+    def __lt__(self, o): return Expr('<', self, o)
+    def __le__(self, o): return Expr('<=', self, o)
+    def __gt__(self, o): return Expr('>', self, o)
+    def __ge__(self, o): return Expr('>=', self, o)
+    def __eq__(self, o): return Expr('==', self, o)
+    def __ne__(self, o): return Expr('!=', self, o)
+    __hash__ = object.__hash__ # nodes are told apart by identity, see _Emitter
+    def __bool__(self):
+        raise TracingError('python control flow on traced values')
+    def __iter__(self):
+        raise TracingError('iterating over a traced value')
+
+def _unary(name):
+    return lambda x: Expr(name, x) if isinstance(x, Expr) else getattr(np, name)(x)
+
+class _Sym(types.SimpleNamespace):
+    '''Stands in for numpy/jax.numpy inside traced functions'''
+    exp = staticmethod(_unary('exp'))
+    expm1 = staticmethod(_unary('expm1'))
+    log = staticmethod(_unary('log'))
+    sqrt = staticmethod(_unary('sqrt'))
+    abs = staticmethod(_unary('abs'))
+    tanh = staticmethod(_unary('tanh'))
+    @staticmethod
+    def where(c, a, b): return Expr('where', c, a, b)
+    @staticmethod
+    def full_like(_, value): return float(value)
+    @staticmethod
+    def zeros_like(_): return 0.
+    @staticmethod
+    def ones_like(_): return 1.
+    @staticmethod
+    def stack(xs): return list(xs)
+    @staticmethod
+    def array(xs): return list(xs)
+    def __getattr__(self, name):
+        raise TracingError(f'unsupported function {name}')
+
+_sym = _Sym()
+
+def _traced(fn):
+    '''fn with numpy/jax.numpy names in its globals replaced by _sym'''
+    fn = getattr(fn, '__func__', fn)
+    g = dict(fn.__globals__)
+    for name, value in fn.__globals__.items():
+        if isinstance(value, types.ModuleType) and value.__name__ in ('numpy', 'jax.numpy'):
+            g[name] = _sym
+    return types.FunctionType(fn.__code__, g, fn.__name__, fn.__defaults__, fn.__closure__)
+
+def _outputs(res, n) -> List[Any]:
+    res = list(res) if isinstance(res, (list, tuple)) else [res]
+    if len(res) != n:
+        raise TracingError(f'expected {n} outputs, got {len(res)}')
+    return res
+
+_comparisons = ('<', '<=', '>', '>=', '==', '!=')
+
+class _Emitter:
+    '''Emits one `const double` per distinct expression, in dependency order.
+    Nodes are keyed by id(), fine since the traced outputs keep them alive,
+    and equal expressions built twice share one local'''
+    def __init__(self, leaves: Dict[int, str]):
+        self.names = dict(leaves)
+        self.codes: Dict[str, str] = {}
+        self.lines: List[str] = []
+    def __call__(self, e) -> str:
+        if not isinstance(e, Expr):
+            if isinstance(e, (bool, np.bool_)):
+                return 'true' if e else 'false'
+            return repr(float(e))
+        if id(e) in self.names:
+            return self.names[id(e)]
+        a = [self(x) for x in e.args]
+        if e.op in ('+', '-', '*', '/') + _comparisons:
+            code = f'({a[0]} {e.op} {a[1]})'
+        elif e.op == 'neg':
+            code = f'(-{a[0]})'
+        elif e.op == 'pow':
+            p = e.args[1]
+            if not isinstance(p, Expr) and float(p).is_integer() and 1 <= p <= 8:
+                code = '(' + ' * '.join([a[0]] * int(p)) + ')'
+            else:
+                code = f'std::pow({a[0]}, {a[1]})'
+        elif e.op == 'where':
+            code = f'({a[0]} ? {a[1]} : {a[2]})'
+        elif e.op == 'abs':
+            code = f'std::fabs({a[0]})'
+        else:
+            code = f'std::{e.op}({a[0]})'
+        if code in self.codes:
+            self.names[id(e)] = self.codes[code]
+            return self.codes[code]
+        name = f't{len(self.lines)}'
+        self.codes[code] = name
+        kind = 'bool' if e.op in _comparisons else 'double'
+        self.lines.append(f'        const {kind} {name} = {code};')
+        self.names[id(e)] = name
+        return name
+
+def _leaves(v, state):
+    leaves = {id(v): 'v'}
+    leaves.update({id(s): f's{i}' for i, s in enumerate(state)})
+    return leaves
+
+def generate(decl) -> str:
+    '''C++ source for init/advance_state/compute_currents of decl, or raise
+    TracingError'''
+    n = len(decl.state)
+    v = Expr('v')
+    state = [Expr('state', i) for i in range(n)]
+    def loop(body, read_state=True):
+        head = ['    for (arb_size_type k = 0; k < pp->width; k++) {',
+                '        const double v = pp->vec_v[pp->node_index[k]];']
+        if read_state:
+            head += [f'        const double s{i} = pp->state_vars[{i}][k];' for i in range(n)]
+        return head + body + ['    }']
+    out = ['// generated by arbor_pycat.codegen, do not edit',
+           '#include <cmath>',
+           '#include <arbor/mechanism_abi.h>',
+           '']
+    emit = _Emitter(_leaves(v, state))
+    init = _outputs(_traced(decl.init)(v), n)
+    names = [emit(x) for x in init]
+    body = emit.lines + [f'        pp->state_vars[{i}][k] = {x};' for i, x in enumerate(names)]
+    out += ['extern "C" void pycat_init(arb_mechanism_ppack * pp) {', *loop(body, read_state=False), '}', '']
+    emit = _Emitter(_leaves(v, state))
+    grad = _outputs(_traced(decl.state_gradient)(v, state), n)
+    names = [emit(x) for x in grad]
+    body = emit.lines + [f'        pp->state_vars[{i}][k] = s{i} + pp->dt * {x};' for i, x in enumerate(names)]
+    out += ['extern "C" void pycat_advance_state(arb_mechanism_ppack * pp) {', *loop(body), '}', '']
+    emit = _Emitter(_leaves(v, state))
+    current, = _outputs(_traced(decl.compute_current)(v, state), 1)
+    name = emit(current)
+    body = emit.lines + [f'        pp->vec_i[pp->node_index[k]] += {name};']
+    out += ['extern "C" void pycat_compute_currents(arb_mechanism_ppack * pp) {', *loop(body), '}', '']
+    return '\n'.join(out)
+
+def cache_dir() -> str:
+    return os.environ.get('ARBOR_PYCAT_CACHE', os.path.join(os.path.expanduser('~'), '.cache', 'arbor_pycat'))
+
+def compile_source(source: str) -> str:
+    '''Path of the shared library for source, compiled on first use'''
+    cxx = os.environ.get('CXX', 'c++')
+    include = os.path.join(arbor.__path__[0], 'include')
+    flags = ['-O3', '-std=c++17', '-shared', '-fPIC', f'-I{include}']
+    # a library built against another arbor or ABI must not be reused
+    versions = [arbor.__version__, str(arbor_pycat._core.abi_version)]
+    key = hashlib.sha256('\0'.join([source, cxx, *flags, *versions]).encode()).hexdigest()[:32]
+    so = os.path.join(cache_dir(), f'{key}.so')
+    if not os.path.exists(so):
+        os.makedirs(cache_dir(), exist_ok=True)
+        src = os.path.join(cache_dir(), f'{key}.cpp')
+        with open(src, 'w') as f:
+            f.write(source)
+        tmp = f'{so}.{os.getpid()}.tmp'
+        subprocess.run([cxx, *flags, src, '-o', tmp], check=True, capture_output=True)
+        os.replace(tmp, so) # atomic, concurrent builds don't see half a library
+    return so
+
+_pending: List[Any] = []
+# (registry core module name, mechanism name) -> library
+_loaded: Dict[Any, Any] = {}
+
+def register(decl, name: str, native: bool = True, registry=None):
+    '''Register declaration decl as density mechanism name. The python path
+    is always installed; build() replaces it by the compiled kernels when
+    tracing and compiling succeed'''
+    registry = registry or arbor_pycat.default_registry
+    n = len(decl.state)
+    arb_mech = registry.core.ArbMech()
+    for i, state in enumerate(decl.state):
+        idx = arb_mech.add_state(state, '', 0.)
+        assert idx == i
+    def init(pp):
+        x = np.asarray(decl.init(pp.v[pp.node_index]), dtype=np.float64).reshape(n, pp.width)
+        pp.set_state(x)
+    def advance_state(pp):
+        v = pp.v[pp.node_index]
+        x = pp.get_state()
+        pp.set_state(x + pp.dt * np.asarray(decl.state_gradient(v, x), dtype=np.float64))
+    def compute_currents(pp):
+        v = pp.v[pp.node_index]
+        np.add.at(pp.i, pp.node_index, np.asarray(decl.compute_current(v, pp.get_state()), dtype=np.float64))
+    arb_mech.set_init(init)
+    arb_mech.set_advance_state(advance_state)
+    arb_mech.set_compute_currents(compute_currents)
+    arb_mech.set_name(name)
+    registry.core.register(arb_mech)
+    if native:
+        _pending.append((registry, decl, name, arb_mech))
+    return arb_mech
+
+def compile_pending(registry=None):
+    '''Called by arbor_pycat.build() before the catalogue is loaded'''
+    registry = registry or arbor_pycat.default_registry
+    todo = [entry for entry in _pending if entry[0] is registry]
+    _pending[:] = [entry for entry in _pending if entry[0] is not registry]
+    for _, decl, name, arb_mech in todo:
+        try:
+            source = generate(decl)
+        except Exception as e: # TracingError, or whatever numpy-isms the tracer tripped over
+            warnings.warn(f'{name}: can not trace ({e}), using the python path', stacklevel=2)
+            continue
+        try:
+            so = compile_source(source)
+        except (OSError, subprocess.CalledProcessError) as e:
+            stderr = getattr(e, 'stderr', b'') or b''
+            warnings.warn(f'{name}: compilation failed, using the python path\n{stderr.decode(errors="replace")}', stacklevel=2)
+            continue
+        lib = ctypes.CDLL(so)
+        _loaded[registry.core.__name__, name] = lib # keep the library mapped
+        arb_mech.set_fingerprint(os.path.basename(so)[:-3])
+        for callback, setter in [('init', arb_mech.set_init_native),
+                                 ('advance_state', arb_mech.set_advance_state_native),
+                                 ('compute_currents', arb_mech.set_compute_currents_native)]:
+            setter(ctypes.cast(getattr(lib, f'pycat_{callback}'), ctypes.c_void_p).value)
+
+def is_native(name: str, registry=None) -> bool:
+    return ((registry or arbor_pycat.default_registry).core.__name__, name) in _loaded
@@ -0,0 +1,187 @@
+// ABI level microbenchmark: drives the arb_mechanism_interface of the
+// mechanisms in bench/mechs.py on synthetic ppacks, without an arbor
+// simulation, and reports ns/call and ns/CV per callback. With threads > 1,
+// every thread drives its own ppack concurrently, like arbor's cell groups,
+// and ns/call is per thread; native paths should stay flat.
+//
+//   bench_abi [max_width] [min_seconds] [threads]
+//
+// Needs arbor_pycat installed and bench/ on PYTHONPATH.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pybind11/embed.h>
+
+#include <dlfcn.h>
+
+#include <arbor/mechanism_abi.h>
+
+namespace py = pybind11;
+
+struct Buffer {
+    // zero-initialised, aligned to the mechanism's requested alignment
+    std::unique_ptr<void, decltype(&std::free)> ptr{nullptr, &std::free};
+    Buffer(size_t bytes, size_t alignment) {
+        bytes = (bytes + alignment - 1) / alignment * alignment;
+        ptr.reset(std::aligned_alloc(alignment, std::max(bytes, alignment)));
+        std::memset(ptr.get(), 0, bytes);
+    }
+    template<typename T> T * as() { return (T*)ptr.get(); }
+};
+
+class SyntheticPP {
+    // one cell, `width` CVs, node_index the identity; every array arbor
+    // would provide is allocated so any callback can run
+    std::vector<Buffer> buffers;
+    std::vector<arb_value_type*> state_rows, param_rows;
+    std::vector<const arb_value_type*> random_rows;
+    std::vector<arb_value_type> globals;
+    std::vector<arb_ion_state> ions;
+    size_t alignment;
+    template<typename T> T * alloc(size_t n, T fill = T()) {
+        buffers.emplace_back(n*sizeof(T), alignment);
+        auto p = buffers.back().as<T>();
+        std::fill(p, p + n, fill);
+        return p;
+    }
+public:
+    arb_mechanism_ppack pp;
+    SyntheticPP(const arb_mechanism_type & type, const arb_mechanism_interface & iface, arb_size_type width) :
+        alignment(std::max<size_t>(iface.alignment, sizeof(void*)))
+    {
+        std::memset(&pp, 0, sizeof(pp));
+        auto pw = std::max<arb_size_type>(iface.partition_width, 1);
+        size_t padded = (width + pw - 1) / pw * pw;
+        pp.width = width;
+        pp.dt = 0.025;
+        pp.vec_v = alloc<arb_value_type>(padded, -65.);
+        pp.vec_i = alloc<arb_value_type>(padded);
+        pp.vec_g = alloc<arb_value_type>(padded);
+        pp.temperature_degC = alloc<arb_value_type>(padded, 6.3);
+        pp.diam_um = alloc<arb_value_type>(padded, 1.);
+        pp.area_um2 = alloc<arb_value_type>(padded, 3.14);
+        pp.vec_ci = alloc<arb_index_type>(padded);
+        pp.weight = alloc<arb_value_type>(padded, 1.);
+        pp.node_index = alloc<arb_index_type>(padded);
+        for (size_t k = 0; k < padded; k++) pp.node_index[k] = std::min<size_t>(k, width - 1);
+        for (size_t k = 0; k < type.n_globals; k++) globals.push_back(type.globals[k].default_value);
+        pp.globals = globals.data();
+        // all rows in one block, like arbor, so padded row spacing is visible
+        auto rows = [&](arb_field_info * fields, size_t n, std::vector<arb_value_type*> & dst) {
+            if (!n) return;
+            auto block = alloc<arb_value_type>(n*padded);
+            for (size_t r = 0; r < n; r++) {
+                dst.push_back(block + r*padded);
+                std::fill(dst.back(), dst.back() + padded, fields[r].default_value);
+            }
+        };
+        rows(type.state_vars, type.n_state_vars, state_rows);
+        rows(type.parameters, type.n_parameters, param_rows);
+        pp.state_vars = state_rows.empty() ? nullptr : state_rows.data();
+        pp.parameters = param_rows.empty() ? nullptr : param_rows.data();
+        for (size_t r = 0; r < type.n_random_variables; r++) random_rows.push_back(alloc<arb_value_type>(padded));
+        pp.random_numbers = random_rows.empty() ? nullptr : random_rows.data();
+        for (size_t k = 0; k < type.n_ions; k++) {
+            arb_ion_state s;
+            s.current_density = alloc<arb_value_type>(padded);
+            s.conductivity = alloc<arb_value_type>(padded);
+            s.reversal_potential = alloc<arb_value_type>(padded, 132.);
+            s.internal_concentration = alloc<arb_value_type>(padded, 5e-5);
+            s.external_concentration = alloc<arb_value_type>(padded, 2.);
+            s.diffusive_concentration = alloc<arb_value_type>(padded, 5e-5);
+            s.ionic_charge = alloc<arb_value_type>(1, 2.);
+            s.index = alloc<arb_index_type>(padded);
+            for (size_t j = 0; j < padded; j++) s.index[j] = pp.node_index[j];
+            ions.push_back(s);
+        }
+        pp.ion_states = ions.empty() ? nullptr : ions.data();
+    }
+    SyntheticPP(const SyntheticPP &) = delete;
+};
+
+static double time_callback(arb_mechanism_method method, arb_mechanism_ppack * pp, double min_seconds) {
+    // ns per call, repeating until min_seconds have passed
+    using clock = std::chrono::steady_clock;
+    method(pp); // warm up view caches
+    size_t reps = 1, done = 0;
+    auto start = clock::now();
+    double elapsed = 0;
+    while (elapsed < min_seconds) {
+        for (size_t r = 0; r < reps; r++) method(pp);
+        done += reps;
+        reps *= 2;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    return elapsed*1e9/done;
+}
+
+static double time_threads(arb_mechanism_method method, std::vector<std::unique_ptr<SyntheticPP>> & synths, double min_seconds) {
+    // mean ns per call per thread, one thread per ppack
+    std::vector<double> ns(synths.size());
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < synths.size(); t++) {
+        threads.emplace_back([&, t]() { ns[t] = time_callback(method, &synths[t]->pp, min_seconds); });
+    }
+    for (auto & thread : threads) thread.join();
+    double sum = 0;
+    for (auto x : ns) sum += x;
+    return sum/ns.size();
+}
+
+int main(int argc, char ** argv) {
+    size_t max_width = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    double min_seconds = argc > 2 ? std::strtod(argv[2], nullptr) : 0.2;
+    size_t n_threads = std::max<size_t>(argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1, 1);
+
+    py::scoped_interpreter interpreter;
+    py::module_::import("mechs");
+    auto so_name = py::module_::import("arbor_pycat._core").attr("get_so_name")().cast<std::string>();
+
+    // the module is already loaded by the import above, this only finds it
+    void * handle = dlopen(so_name.c_str(), RTLD_NOW | RTLD_NOLOAD);
+    if (!handle) { std::fprintf(stderr, "dlopen %s: %s\n", so_name.c_str(), dlerror()); return 1; }
+    auto get_catalogue = (const void*(*)(int*))dlsym(handle, "get_catalogue");
+    if (!get_catalogue) { std::fprintf(stderr, "no get_catalogue in %s\n", so_name.c_str()); return 1; }
+
+    int count = 0;
+    auto mechanisms = (const arb_mechanism*)get_catalogue(&count);
+    std::vector<std::pair<arb_mechanism_type, arb_mechanism_interface*>> loaded;
+    for (int ix = 0; ix < count; ix++) {
+        // same order as arbor's load_catalogue
+        auto type = mechanisms[ix].type();
+        loaded.emplace_back(type, mechanisms[ix].i_cpu());
+    }
+
+    // arbor calls us from its own threads without holding the GIL
+    py::gil_scoped_release release;
+    std::printf("%-16s %-18s %9s %7s %14s %10s\n", "mechanism", "callback", "width", "threads", "ns/call", "ns/cv");
+    for (auto & [type, iface] : loaded) {
+        for (size_t width = 1; width <= max_width; width *= 10) {
+            std::vector<std::unique_ptr<SyntheticPP>> synths;
+            for (size_t t = 0; t < n_threads; t++) {
+                synths.push_back(std::make_unique<SyntheticPP>(type, *iface, width));
+                iface->init_mechanism(&synths.back()->pp);
+            }
+            std::pair<const char *, arb_mechanism_method> callbacks[] = {
+                {"advance_state", iface->advance_state},
+                {"compute_currents", iface->compute_currents},
+                {"write_ions", iface->write_ions},
+            };
+            for (auto & [name, method] : callbacks) {
+                double ns = n_threads > 1 ? time_threads(method, synths, min_seconds)
+                                          : time_callback(method, &synths[0]->pp, min_seconds);
+                std::printf("%-16s %-18s %9zu %7zu %14.1f %10.3f\n", type.name, name, width, n_threads, ns, ns/width);
+            }
+            std::fflush(stdout);
+        }
+    }
+    return 0;
+}
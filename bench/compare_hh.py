@@ -0,0 +1,60 @@
+'''Wall time of one cell with N CVs using arbor's builtin hh versus the
+python (bench_hh, and bench_hh_padded with a padded SIMD layout) and
+lookup-table (bench_lut_hh) versions from mechs.py.
+
+    python bench/compare_hh.py [n_cvs ...]
+'''
+import sys
+import time
+import arbor
+import arbor_pycat
+import mechs # noqa: F401, registers the bench mechanisms
+
+try:
+    from arbor import units as U
+    mV = U.mV
+    ms = U.ms
+    nA = U.nA
+except ImportError:
+    mV = ms = nA = 1
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(0, 0, 0, 1), arbor.mpoint(1000, 0, 0, 1), tag=1)
+labels = arbor.label_dict({"all": "(tag 1)", "start": "(location 0 0)"})
+
+class recipe(arbor.recipe):
+    def __init__(self, mech, n_cvs):
+        arbor.recipe.__init__(self)
+        self.mech = mech
+        self.n_cvs = n_cvs
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid):
+        decor = (
+            arbor.decor()
+            .set_property(Vm=-65*mV)
+            .paint('"all"', arbor.density(self.mech))
+            .place('"start"', arbor.iclamp(10*ms, 80*ms, 0.1*nA), 'iclamp')
+            .discretization(arbor.cv_policy_fixed_per_branch(self.n_cvs))
+        )
+        return arbor.cable_cell(tree, decor, labels)
+    def global_properties(self, kind): return self.the_props
+
+def run(mech, n_cvs, tfinal=100, dt=0.025):
+    sim = arbor.simulation(recipe(mech, n_cvs))
+    start = time.perf_counter()
+    sim.run(tfinal=tfinal, dt=dt)
+    return time.perf_counter() - start
+
+sizes = [int(x) for x in sys.argv[1:]] or [1, 16, 128, 1024]
+print(f'{"n_cvs":>7} {"mechanism":>15} {"seconds":>9} {"vs hh":>8}')
+for n_cvs in sizes:
+    base = run('hh', n_cvs)
+    print(f'{n_cvs:7} {"hh":>15} {base:9.3f} {1:8.1f}')
+    for mech in ['bench_hh', 'bench_hh_padded', 'bench_lut_hh']:
+        t = run(mech, n_cvs)
+        print(f'{n_cvs:7} {mech:>15} {t:9.3f} {t/base:8.1f}')
@@ -0,0 +1,86 @@
+'''Mechanisms driven by the benchmarks: registered, but no catalogue is built,
+so bench_abi can call get_catalogue itself.'''
+import numpy as np
+import arbor_pycat
+
+def exprelr(x): return np.where(np.isclose(x, 0), 1., x / np.expm1(x))
+def alpha_m(v): return exprelr(-(v + 40) / 10)
+def beta_m(v):  return 4 * np.exp(-(v + 65) / 18)
+def alpha_h(v): return 0.07 * np.exp(-(v + 65) / 20)
+def beta_h(v):  return 1 / (np.exp(-(v + 35) / 10) + 1)
+def alpha_n(v): return 0.1 * exprelr(-(v + 55) / 10)
+def beta_n(v):  return 0.125 * np.exp(-(v + 65) / 80)
+
+HH_PARAMETERS = [('gnabar', 'S/cm2', 0.12),
+                 ('gkbar',  'S/cm2', 0.036),
+                 ('gl',     'S/cm2', 0.0003),
+                 ('ena',    'mV',    50),
+                 ('ek',     'mV',   -77),
+                 ('el',     'mV',   -54.3)]
+
+@arbor_pycat.register
+class BenchPassive(arbor_pycat.CustomMechanism):
+    name = 'bench_passive'
+    def compute_currents(self, pp):
+        pp.i_local += (pp.v_local + 65) * 1e-4
+
+@arbor_pycat.register
+class BenchHH(arbor_pycat.CustomMechanism):
+    name = 'bench_hh'
+    state_vars = [('m', '', 0.), ('h', '', 0.), ('n', '', 0.)]
+    parameters = HH_PARAMETERS
+    def init_mechanism(self, pp):
+        v = pp.v_local
+        pp.m = alpha_m(v) / (alpha_m(v) + beta_m(v))
+        pp.h = alpha_h(v) / (alpha_h(v) + beta_h(v))
+        pp.n = alpha_n(v) / (alpha_n(v) + beta_n(v))
+    def advance_state(self, pp):
+        v = pp.v_local
+        for x, a, b in ((pp.m, alpha_m(v), beta_m(v)),
+                        (pp.h, alpha_h(v), beta_h(v)),
+                        (pp.n, alpha_n(v), beta_n(v))):
+            inf = a / (a + b)
+            x[:] = inf + (x - inf) * np.exp(-pp.dt * (a + b))
+    def compute_currents(self, pp):
+        v = pp.v_local
+        gna = pp.gnabar * pp.m**3 * pp.h
+        gk = pp.gkbar * pp.n**4
+        pp.i_local += 10 * pp.weight * (gna*(v - pp.ena) + gk*(v - pp.ek) + pp.gl*(v - pp.el))
+        pp.g_local += 10 * pp.weight * (gna + gk + pp.gl)
+
+@arbor_pycat.register
+class BenchPaddedHH(BenchHH):
+    '''BenchHH on SIMD friendly rows: 64 byte aligned and padded to blocks of
+    8, with advance_state working on whole padded rows'''
+    name = 'bench_hh_padded'
+    partition_width = 8
+    alignment = 64
+    def advance_state(self, pp):
+        v = np.full(pp.padded_width, -65.)
+        v[:pp.width] = pp.v_local
+        for x, a, b in ((pp.m_padded, alpha_m(v), beta_m(v)),
+                        (pp.h_padded, alpha_h(v), beta_h(v)),
+                        (pp.n_padded, alpha_n(v), beta_n(v))):
+            inf = a / (a + b)
+            x[:] = inf + (x - inf) * np.exp(-pp.dt * (a + b))
+
+@arbor_pycat.register
+class BenchLutHH(arbor_pycat.RateMechanism):
+    name = 'bench_lut_hh'
+    parameters = HH_PARAMETERS
+    gates = [arbor_pycat.Gate('m', alpha_m, beta_m),
+             arbor_pycat.Gate('h', alpha_h, beta_h),
+             arbor_pycat.Gate('n', alpha_n, beta_n)]
+    currents = [arbor_pycat.Current('gnabar', 'ena', {'m': 3, 'h': 1}),
+                arbor_pycat.Current('gkbar', 'ek', {'n': 4}),
+                arbor_pycat.Current('gl', 'el')]
+
+@arbor_pycat.register
+class BenchCa(arbor_pycat.CustomMechanism):
+    name = 'bench_ca'
+    parameters = [('gca', 'S/cm2', 1e-4)]
+    ions = [arbor_pycat.IonInfo('ca', write_int_concentration=True)]
+    def compute_currents(self, pp):
+        pp.ica[pp.index_ca] += pp.gca * (pp.v_local - pp.eca[pp.index_ca])
+    def write_ions(self, pp):
+        pp.cai[pp.index_ca] += 1e-3 * pp.dt * pp.ica[pp.index_ca]
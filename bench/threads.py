@@ -0,0 +1,73 @@
+'''Thread scaling on a multi-cell recipe: every cell is its own cell group,
+so arbor can advance them in parallel. Python callbacks serialize on the
+GIL (see the `gil` column, the time spent waiting for it), while
+lookup-table and native mechanisms run without it.
+
+    python bench/threads.py [max_threads] [n_cells] [n_cvs]
+'''
+import os
+import sys
+import time
+import arbor
+import arbor_pycat
+import mechs # noqa: F401, registers the bench mechanisms
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+max_threads = int(sys.argv[1]) if len(sys.argv) > 1 else os.cpu_count()
+n_cells = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+n_cvs = int(sys.argv[3]) if len(sys.argv) > 3 else 64
+
+cat = arbor_pycat.build()
+core = arbor_pycat._core
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(0, 0, 0, 1), arbor.mpoint(100, 0, 0, 1), tag=1)
+labels = arbor.label_dict({"all": "(tag 1)"})
+
+class recipe(arbor.recipe):
+    def __init__(self, mech):
+        arbor.recipe.__init__(self)
+        self.mech = mech
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return n_cells
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid):
+        decor = (
+            arbor.decor()
+            .set_property(Vm=(-65 + gid % 10)*mV)
+            .paint('"all"', arbor.density(self.mech))
+            .discretization(arbor.cv_policy_fixed_per_branch(n_cvs))
+        )
+        return arbor.cable_cell(tree, decor, labels)
+    def global_properties(self, kind): return self.the_props
+
+def run(mech, threads):
+    rec = recipe(mech)
+    ctx = arbor.context(threads=threads)
+    hint = {arbor.cell_kind.cable: arbor.partition_hint(cpu_group_size=1)}
+    decomp = arbor.partition_load_balance(rec, ctx, hint)
+    sim = arbor.simulation(rec, ctx, decomp)
+    core.reset_stats()
+    start = time.perf_counter()
+    sim.run(tfinal=20, dt=0.025)
+    elapsed = time.perf_counter() - start
+    gil = sum(cb['gil'] for cb in core.stats().get(mech, {}).values())
+    return elapsed, gil
+
+core.enable_stats()
+threads = [1]
+while threads[-1]*2 <= max_threads:
+    threads.append(threads[-1]*2)
+print(f'{"mechanism":>14} {"threads":>7} {"seconds":>9} {"speedup":>8} {"gil":>8}')
+for mech in ['hh', 'bench_hh', 'bench_lut_hh']:
+    base = None
+    for n in threads:
+        t, gil = run(mech, n)
+        base = base or t
+        print(f'{mech:>14} {n:7} {t:9.3f} {base/t:8.2f} {gil:8.3f}')
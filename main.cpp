@@ -1,6 +1,24 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <limits>
 #include <stdexcept>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 #include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
@@ -10,6 +28,9 @@
 
 #include <unistd.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define IGNORE(x) ((void)(1+x))
 #define ERROR(x) do { \
@@ -88,11 +109,40 @@ void frozen_check(bool check = false) {
     }
 }
 
+template<typename T>
+class ArbPPArray {
+public:
+    ssize_t size;
+    T * raw;
+    bool ro = false;
+    ArbPPArray(size_t size, T * raw, bool ro=false) : size(size), raw(raw), ro(ro) {}
+    py::array_t<T> to_numpy() {
+        if (!raw) ERROR("trying to make a nullpointer into a numpy array");
+        return py::array_t<T>(size, raw, py::none());
+    }
+};
+
+template<typename T>
+py::array_t<T> cached_view(py::object & slot, ssize_t size, T * raw) {
+    // numpy views are created on first access and then kept alive for as long
+    // as the ppack they point into, so steady-state accesses do not allocate
+    if (!slot) slot = ArbPPArray<T>(size, raw).to_numpy();
+    return py::reinterpret_borrow<py::array_t<T>>(slot);
+}
+
 class ArbIonState {
 public:
     ssize_t size_of_index_array;
     arb_ion_state * raw;
     int size_of_data_arrays;
+    py::object current_density;
+    py::object conductivity;
+    py::object reversal_potential;
+    py::object internal_concentration;
+    py::object external_concentration;
+    py::object diffusive_concentration;
+    py::object ionic_charge;
+    py::object index;
     ArbIonState(ssize_t size, arb_ion_state * raw) : size_of_index_array(size), raw(raw) {
         int maxidx = 0;
         for (ssize_t i = 0; i < size; i++) {
@@ -102,66 +152,506 @@ public:
         }
         size_of_data_arrays = maxidx + 1;
     }
+    py::array_t<arb_value_type> data(py::object & slot, arb_value_type * ptr) {
+        return cached_view(slot, size_of_data_arrays, ptr);
+    }
 };
 
-template<typename T>
-class ArbPPArray {
+// Minimal DLPack ABI (unversioned "dltensor" capsules), enough to hand
+// arbor's buffers to jax/torch and take results back without copies
+struct DLDevice { int32_t device_type; int32_t device_id; };
+struct DLDataType { uint8_t code; uint8_t bits; uint16_t lanes; };
+struct DLTensor {
+    void * data;
+    DLDevice device;
+    int32_t ndim;
+    DLDataType dtype;
+    int64_t * shape;
+    int64_t * strides; // in elements
+    uint64_t byte_offset;
+};
+struct DLManagedTensor {
+    DLTensor dl_tensor;
+    void * manager_ctx;
+    void (*deleter)(DLManagedTensor * self);
+};
+const int32_t kDLCPU = 1;
+const uint8_t kDLInt = 0;
+const uint8_t kDLFloat = 2;
+
+static void dlpack_capsule_destructor(PyObject * capsule) {
+    // only called for capsules nobody consumed (consumers rename to used_dltensor)
+    if (!PyCapsule_IsValid(capsule, "dltensor")) return;
+    auto managed = (DLManagedTensor*)PyCapsule_GetPointer(capsule, "dltensor");
+    if (managed->deleter) managed->deleter(managed);
+}
+
+class ArbDLArray {
+    // owns no memory: only valid while the arbor ppack it points into is
+    struct Context {
+        DLManagedTensor managed;
+        std::vector<int64_t> shape;
+        std::vector<int64_t> strides;
+    };
 public:
-    ssize_t size;
-    T * raw;
-    bool ro = false;
-    ArbPPArray(size_t size, T * raw, bool ro=false) : size(size), raw(raw), ro(ro) {}
-    py::array_t<T> to_numpy() {
-        if (!raw) ERROR("trying to make a nullpointer into a numpy array");
-        return py::array_t<T>(size, raw, py::none());
+    void * data;
+    DLDataType dtype;
+    std::vector<int64_t> shape;
+    std::vector<int64_t> strides;
+    template<typename T>
+    ArbDLArray(T * data, std::vector<int64_t> shape, std::vector<int64_t> strides) :
+        data((void*)data),
+        dtype({std::is_floating_point<T>::value ? kDLFloat : kDLInt, (uint8_t)(8*sizeof(T)), 1}),
+        shape(shape), strides(strides) {}
+    py::object to_dlpack() const {
+        auto ctx = new Context{{}, shape, strides};
+        ctx->managed.dl_tensor = {data, {kDLCPU, 0}, (int32_t)shape.size(), dtype, ctx->shape.data(), ctx->strides.data(), 0};
+        ctx->managed.manager_ctx = ctx;
+        ctx->managed.deleter = [](DLManagedTensor * self) { delete (Context*)self->manager_ctx; };
+        return py::reinterpret_steal<py::object>(PyCapsule_New(&ctx->managed, "dltensor", dlpack_capsule_destructor));
+    }
+    py::array to_numpy() const {
+        std::vector<ssize_t> np_shape(shape.begin(), shape.end());
+        std::vector<ssize_t> np_strides;
+        for (auto stride : strides) np_strides.push_back(stride * dtype.bits / 8);
+        return py::array(py::dtype(dtype.code == kDLFloat ? "d" : "i"), np_shape, np_strides, data, py::none());
     }
 };
 
-template<typename T>
-py::array_t<T> stack(std::vector<py::array_t<T>> & arrays) {
-    py::array_t<T, py::array::f_style> res({(int)arrays.size(), (int)arrays.at(0).size()});
-    for (size_t i = 0; i < arrays.size(); i++) {
-        res[py::make_tuple(i, py::ellipsis())] = arrays.at(i);
+// callback profiler, off by default: when disabled a trampoline only pays
+// for one branch on `profiling`
+// written from python while arbor threads read it
+std::atomic<bool> profiling{false};
+
+enum Callback { cb_init, cb_advance_state, cb_compute_currents, cb_write_ions, cb_apply_events, cb_post_event, n_callbacks };
+const char * callback_names[n_callbacks] = { "init", "advance_state", "compute_currents", "write_ions", "apply_events", "post_event" };
+
+struct CallStats {
+    // wall times in ns; the histogram has 4 buckets per octave for p99
+    static constexpr size_t n_buckets = 4*40;
+    uint64_t count = 0;
+    uint64_t width = 0; // summed over calls
+    double total = 0;
+    double min = std::numeric_limits<double>::max();
+    double max = 0;
+    double gil = 0;     // waiting for the GIL, i.e. contention between arbor threads
+    double view = 0;    // PP and numpy view lookup/construction
+    double handler = 0; // python handler call
+    std::array<uint64_t, n_buckets> hist{};
+    void add(double ns, arb_size_type w) {
+        count += 1;
+        width += w;
+        total += ns;
+        min = std::min(min, ns);
+        max = std::max(max, ns);
+        size_t bucket = ns > 1 ? (size_t)(4*std::log2(ns)) : 0;
+        hist[std::min(bucket, n_buckets - 1)] += 1;
     }
-    return res;
-}
+    double p99() const {
+        uint64_t seen = 0;
+        for (size_t b = 0; b < n_buckets; b++) {
+            seen += hist[b];
+            if (100*seen >= 99*count) return std::min(std::exp2((b + 1)/4.), max);
+        }
+        return max;
+    }
+};
 
 class ArbMech;
 
 class PP {
+    // One PP lives as long as the arbor ppack it wraps: widths, ion index sizes
+    // and numpy views are computed once and reused by every callback.
     arb_mechanism_ppack* pp;
-    std::shared_ptr<ArbMech> mech; // just for index check, could remove for performance
+    ArbMech * mech;
     int max_node_index = 0; // node_index has get_width size, but max index into v could be higher
-public:
-    PP(arb_mechanism_ppack* pp, std::shared_ptr<ArbMech> mech) : pp(pp), mech(mech) {
-        // slow, inefficient etc but still O(n). should precalculate
-        int maxidx = 0;
-        for (size_t i = 0; i < pp->width; i++) {
-            if (pp->node_index[i] > maxidx) {
-                maxidx = pp->node_index[i];
-            }
+    arb_size_type width;
+    arb_index_type * node_index_raw;
+    arb_value_type * vec_v_raw;
+    arb_value_type ** state_vars_raw;
+    py::object node_index_view;
+    py::object v_view;
+    py::object i_view;
+    py::object g_view;
+    py::object t_degC_view;
+    py::object diam_um_view;
+    py::object area_um2_view;
+    py::object weight_view;
+    py::object cell_index_view;
+    py::object time_since_spike_view;
+    int n_cells = 0; // cells covered, for indexing time_since_spike
+    std::vector<py::object> state_views;
+    std::vector<py::object> param_views;
+    std::vector<py::object> random_views;
+    std::vector<ArbIonState> ion_states;
+    // batched ion access: one reusable [n_ions, width] buffer per field
+    enum IonField { ion_i, ion_g, ion_erev, ion_xi, ion_xo, ion_xd, n_ion_fields };
+    std::array<py::object, n_ion_fields> ion_gathers;
+    static IonField ion_field(const std::string & name);
+    static arb_value_type * ion_field_data(arb_ion_state & s, IonField f);
+    // node_index classified once per ppack, so v/i/g of our own CVs can be
+    // plain slices instead of fancy-index gathers in the common cases
+    enum class NodeLayout { identity, contiguous, general };
+    NodeLayout layout = NodeLayout::general;
+    arb_index_type node_offset = 0;
+    py::object v_local_view;
+    py::object i_local_view;
+    py::object g_local_view;
+    struct LocalGather {
+        // general layout: gathered copy handed to python; differences are
+        // scatter-added back after the callback so += accumulates per instance
+        py::object array;
+        arb_value_type * data = nullptr;
+        std::vector<arb_value_type> orig;
+        bool active = false;
+    };
+    LocalGather v_gather, i_gather, g_gather;
+    py::array_t<arb_value_type> local(py::object & slot, LocalGather & buf, arb_value_type * src);
+    // distance between consecutive state/parameter rows, -1 if not uniform
+    int64_t state_stride = -1;
+    int64_t param_stride = -1;
+    // rows arbor allocated per state/parameter, >= width when the mechanism
+    // asked for a partition_width; the tail is scratch space for SIMD blocks
+    ssize_t padded_width;
+    std::vector<py::object> state_padded_views;
+    std::vector<py::object> param_padded_views;
+    py::object states_view;
+    py::object params_view;
+    // fused mode: outputs returned by the step handler, applied natively by
+    // the compute_currents/write_ions trampolines until replaced
+    struct {
+        std::vector<arb_value_type> i, g, ion_i, ion_g, ion_xi, ion_xo, ion_erev;
+    } staged;
+    // update_every > 1: what the last python call did to a shared array,
+    // replayed natively on the skipped steps
+    struct Replay {
+        std::vector<arb_index_type> index; // unique targets
+        std::vector<arb_value_type> before, values;
+        void reset(const arb_index_type * idx, size_t n) {
+            index.assign(idx, idx + n);
+            std::sort(index.begin(), index.end());
+            index.erase(std::unique(index.begin(), index.end()), index.end());
+            before.resize(index.size());
+            values.resize(index.size());
         }
-        max_node_index = maxidx;
+        void snapshot(const arb_value_type * src) { for (size_t k = 0; k < index.size(); k++) before[k] = src[index[k]]; }
+        void delta(const arb_value_type * src) { for (size_t k = 0; k < index.size(); k++) values[k] = src[index[k]] - before[k]; }
+        void record(const arb_value_type * src) { for (size_t k = 0; k < index.size(); k++) values[k] = src[index[k]]; }
+        void add(arb_value_type * dst) const { for (size_t k = 0; k < index.size(); k++) dst[index[k]] += values[k]; }
+        void assign(arb_value_type * dst) const { for (size_t k = 0; k < index.size(); k++) dst[index[k]] = values[k]; }
+    };
+    // float32 mode: single precision copies handed to python; state changes
+    // and current contributions are accumulated back in double afterwards
+    struct {
+        std::vector<float> v, i, g, state, state0, param;
+        py::object v_view, i_view, g_view, states_view, params_view;
+        std::vector<py::object> state_rows, param_rows;
+    } f32;
+    // constant outputs: python runs again once marked dirty
+    struct {
+        bool currents = true, ions = true;
+    } dirty;
+    struct {
+        uint64_t step = 0;
+        arb_value_type dt_scale = 1;
+        Replay i, g;
+        std::vector<Replay> ion_i, ion_g, ion_xi, ion_xo, ion_erev;
+        std::vector<arb_value_type> state0, slope; // extrapolate: per-step state change
+    } sub;
+public:
+    PP(arb_mechanism_ppack* pp, ArbMech * mech);
+    bool wraps(arb_mechanism_ppack* other) const {
+        return other == pp
+            && other->width == width
+            && other->node_index == node_index_raw
+            && other->vec_v == vec_v_raw
+            && other->state_vars == state_vars_raw;
     }
     ssize_t get_width() { return pp->width; } //  _pp_var_width
     ssize_t get_nwidth() { return max_node_index + 1; }
-    double get_dt() { return pp->dt; } // _pp_var_dt
-    py::array_t<arb_index_type> node_index() { return ArbPPArray(get_width(), pp->node_index, true).to_numpy(); }
+    double get_dt() { return pp->dt*sub.dt_scale; } // _pp_var_dt, times update_every in advance_state
+    py::array_t<arb_index_type> node_index() { return cached_view(node_index_view, get_width(), pp->node_index); }
     arb_value_type glob(int idx) { return pp->globals[idx]; }
-    py::array_t<arb_value_type> v(){ return ArbPPArray<arb_value_type>(get_nwidth(), pp->vec_v).to_numpy(); }
-    py::array_t<arb_value_type> i(){ return ArbPPArray<arb_value_type>(get_nwidth(), pp->vec_i).to_numpy(); }
-    py::array_t<arb_value_type> g(){ return ArbPPArray<arb_value_type>(get_nwidth(), pp->vec_g).to_numpy(); }
-    py::array_t<arb_value_type> t_degC(){ return ArbPPArray<arb_value_type>(max_node_index+1, pp->temperature_degC).to_numpy(); }
-    py::array_t<arb_value_type> diam_um(){ return ArbPPArray<arb_value_type>(max_node_index+1, pp->diam_um).to_numpy(); }
-    py::array_t<arb_value_type> area_um2(){ return ArbPPArray<arb_value_type>(max_node_index+1, pp->area_um2).to_numpy(); }
+    py::array_t<arb_value_type> v(){ return cached_view(v_view, get_nwidth(), pp->vec_v); }
+    py::array_t<arb_value_type> i(){ return cached_view(i_view, get_nwidth(), pp->vec_i); }
+    py::array_t<arb_value_type> g(){ return cached_view(g_view, get_nwidth(), pp->vec_g); }
+    py::array_t<arb_value_type> t_degC(){ return cached_view(t_degC_view, get_nwidth(), pp->temperature_degC); }
+    py::array_t<arb_value_type> diam_um(){ return cached_view(diam_um_view, get_nwidth(), pp->diam_um); }
+    py::array_t<arb_value_type> area_um2(){ return cached_view(area_um2_view, get_nwidth(), pp->area_um2); }
+    py::array_t<arb_value_type> v_local(){ return local(v_local_view, v_gather, pp->vec_v); }
+    py::array_t<arb_value_type> i_local(){ return local(i_local_view, i_gather, pp->vec_i); }
+    py::array_t<arb_value_type> g_local(){ return local(g_local_view, g_gather, pp->vec_g); }
+    std::string node_layout() {
+        switch (layout) {
+            case NodeLayout::identity: return "identity";
+            case NodeLayout::contiguous: return "contiguous";
+            default: return "general";
+        }
+    }
+    void scatter_local();
+    void to_float32();
+    void from_float32();
+    py::array_t<float> v32() { return cached_view(f32.v_view, get_width(), f32.v.data()); }
+    py::array_t<float> i32() { return cached_view(f32.i_view, get_width(), f32.i.data()); }
+    py::array_t<float> g32() { return cached_view(f32.g_view, get_width(), f32.g.data()); }
+    py::object states32();
+    py::object params32();
+    py::array_t<float> state32(size_t idx);
+    py::array_t<float> param32(size_t idx);
+    py::array_t<arb_value_type> weight(){ return cached_view(weight_view, get_width(), pp->weight); }
+    py::array_t<arb_index_type> cell_index(){ return cached_view(cell_index_view, get_nwidth(), pp->vec_ci); }
+    int get_n_cells() { return n_cells; }
+    ssize_t n_detectors() { return pp->n_detectors; }
+    // one entry per (cell, detector): time_since_spike[cell_index[node]*n_detectors + d]
+    py::array_t<arb_value_type> time_since_spike(){ return cached_view(time_since_spike_view, n_cells*n_detectors(), pp->time_since_spike); }
     py::array_t<arb_value_type> state(size_t idx);
-    void set_state(py::array_t<arb_value_type> &);
+    ssize_t get_padded_width() { return padded_width; }
+    py::array_t<arb_value_type> state_padded(size_t idx);
+    py::array_t<arb_value_type> param_padded(size_t idx);
+    ArbDLArray states_dlarray();
+    ArbDLArray params_dlarray();
+    ArbDLArray dlarray(const std::string & name);
+    py::object states() { if (!states_view) states_view = states_dlarray().to_numpy(); return states_view; }
+    py::object params() { if (!params_view) params_view = params_dlarray().to_numpy(); return params_view; }
+    void set_state(py::array_t<arb_value_type, py::array::c_style | py::array::forcecast> &);
+    void set_state_from_dlpack(py::object obj);
     py::array_t<arb_value_type> get_state();
-    py::array_t<arb_value_type> get_diff_ions();
-    void set_diff_ions(py::array_t<arb_value_type> & val);
+    py::array_t<arb_value_type> gather_ions(const std::string & field);
+    void scatter_ions(const std::string & field, py::array_t<arb_value_type, py::array::c_style | py::array::forcecast> & val, bool accumulate);
+    py::array_t<arb_value_type> get_diff_ions() {
+        // a new array on every call, as before gather_ions; only gather_ions
+        // reuses its buffer
+        auto shared = gather_ions("xd");
+        py::array_t<arb_value_type> res({shared.shape(0), shared.shape(1)});
+        std::memcpy(res.mutable_data(), shared.data(), shared.size()*sizeof(arb_value_type));
+        return res;
+    }
+    void set_diff_ions(py::array_t<arb_value_type, py::array::c_style | py::array::forcecast> & val) { scatter_ions("xd", val, false); }
     py::array_t<arb_value_type> param(size_t idx);
     py::array_t<arb_value_type> random(size_t idx);
-    ArbIonState ions(size_t idx);
+    ArbIonState & ions(size_t idx);
+    void stage(py::handle result);
+    void apply_staged_currents();
+    void apply_staged_ions();
+    // update_every: the python callbacks run on the first step of every
+    // window; advance_state then sees dt*update_every
+    bool slow_step(bool after_advance = false) const;
+    void next_step() { sub.step += 1; }
+    void set_dt_scale(arb_value_type scale) { sub.dt_scale = scale; }
+    // update_every or constant outputs: whether this step reapplies the last
+    // python outputs instead of calling python
+    bool skip_currents() const;
+    bool skip_ions() const;
+    void mark_dirty() { dirty.currents = dirty.ions = true; }
+    void begin_currents();
+    void end_currents();
+    void replay_currents() const;
+    void begin_ions() { dirty.ions = false; }
+    void end_ions();
+    void replay_ions() const;
+    void begin_state();
+    void end_state();
+    void replay_state();
+};
+
+class RateTables {
+    // gating rates that only depend on v: alpha(v) and beta(v) are tabulated
+    // once from python at get_catalogue time, after which init, advance_state
+    // and compute_currents run natively with linear interpolation
+public:
+    struct Gate {
+        size_t state;
+        py::function alpha_fn;
+        py::function beta_fn;
+        std::vector<arb_value_type> alpha;
+        std::vector<arb_value_type> beta;
+    };
+    struct Current {
+        size_t gbar; // parameter index
+        size_t erev; // parameter index
+        std::vector<std::pair<size_t, int>> powers; // (state index, exponent)
+    };
+    arb_value_type vmin = -100;
+    arb_value_type vmax = 100;
+    size_t n = 0;
+    arb_value_type scale = 0;
+    std::vector<Gate> gates;
+    std::vector<Current> currents;
+    bool enabled() const { return !gates.empty() || !currents.empty(); }
+    void tabulate();
+    void lookup(const Gate & gate, arb_value_type v, arb_value_type & a, arb_value_type & b) const {
+        arb_value_type x = std::min(std::max((v - vmin)*scale, (arb_value_type)0), (arb_value_type)(n - 1));
+        size_t k = std::min((size_t)x, n - 2);
+        arb_value_type f = x - k;
+        a = gate.alpha[k] + f*(gate.alpha[k+1] - gate.alpha[k]);
+        b = gate.beta[k] + f*(gate.beta[k+1] - gate.beta[k]);
+    }
+    void init(arb_mechanism_ppack * pp) const;
+    void advance_state(arb_mechanism_ppack * pp) const;
+    void compute_currents(arb_mechanism_ppack * pp) const;
+};
+
+class Recorder {
+    // Samples fields of every ppack into per-ppack buffers from the
+    // advance_state trampoline; full buffers are handed to a writer thread
+    // and appended to the file as frames:
+    //   uint32 stream, uint32 n_cols, uint64 n_rows, double[n_rows][n_cols]
+    // Columns are the step, then one column per (field, selected instance).
+    // Each stream starts with a header frame, its id or'ed with header_flag,
+    // of 2 rows over the selected instances: their CV (node_index) and cell
+    // (vec_ci), both local to the ppack's cell group.
+public:
+    enum Kind { state, v, i, g, ion_i, ion_g, ion_erev, ion_xi, ion_xo, ion_xd };
+    static constexpr uint32_t header_flag = 0x80000000u;
+    struct Field { Kind kind; size_t index; };
+private:
+    struct Stream {
+        uint32_t id;
+        // ppack the stream was set up for; the allocator may hand its
+        // address to a ppack of a later simulation
+        arb_size_type width;
+        const arb_index_type * node_index;
+        uint64_t step = 0;
+        std::vector<size_t> instances;
+        std::vector<arb_value_type> buf;
+        size_t cols;
+    };
+    struct Frame { uint32_t id; uint32_t cols; uint64_t rows; std::vector<arb_value_type> data; };
+    std::vector<Field> fields;
+    unsigned stride;
+    std::vector<arb_index_type> cvs; // empty: all instances
+    size_t capacity; // rows per buffer
+    std::unordered_map<arb_mechanism_ppack*, std::unique_ptr<Stream>> streams;
+    uint32_t next_id = 0;
+    std::mutex streams_mutex;
+    FILE * out;
+    std::thread writer;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<Frame> queue;
+    std::vector<std::vector<arb_value_type>> spare; // recycled buffers
+    bool stopping = false;
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        for (;;) {
+            queue_cv.wait(lock, [&]{ return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            auto frame = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            std::fwrite(&frame.id, sizeof(frame.id), 1, out);
+            std::fwrite(&frame.cols, sizeof(frame.cols), 1, out);
+            std::fwrite(&frame.rows, sizeof(frame.rows), 1, out);
+            std::fwrite(frame.data.data(), sizeof(arb_value_type), frame.data.size(), out);
+            frame.data.clear();
+            lock.lock();
+            spare.push_back(std::move(frame.data));
+        }
+    }
+    void flush(Stream & stream) {
+        if (stream.buf.empty()) return;
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        std::vector<arb_value_type> next;
+        if (!spare.empty()) { next = std::move(spare.back()); spare.pop_back(); }
+        next.reserve(capacity*stream.cols);
+        uint64_t rows = stream.buf.size()/stream.cols;
+        queue.push_back({stream.id, (uint32_t)stream.cols, rows, std::move(stream.buf)});
+        stream.buf = std::move(next);
+        queue_cv.notify_one();
+    }
+    void header(const Stream & stream, const arb_mechanism_ppack * pp) {
+        std::vector<arb_value_type> data;
+        for (auto k : stream.instances) data.push_back(pp->node_index[k]);
+        for (auto k : stream.instances) data.push_back(pp->vec_ci ? pp->vec_ci[pp->node_index[k]] : 0);
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back({stream.id | header_flag, (uint32_t)stream.instances.size(), 2, std::move(data)});
+        queue_cv.notify_one();
+    }
+    static const arb_value_type * source(const Field & f, arb_mechanism_ppack * pp, const arb_index_type *& index) {
+        index = pp->node_index;
+        if (f.kind == state) { index = nullptr; return pp->state_vars[f.index]; }
+        if (f.kind == v) return pp->vec_v;
+        if (f.kind == i) return pp->vec_i;
+        if (f.kind == g) return pp->vec_g;
+        auto & ion = pp->ion_states[f.index];
+        index = ion.index;
+        switch (f.kind) {
+            case ion_i: return ion.current_density;
+            case ion_g: return ion.conductivity;
+            case ion_erev: return ion.reversal_potential;
+            case ion_xi: return ion.internal_concentration;
+            case ion_xo: return ion.external_concentration;
+            default: return ion.diffusive_concentration;
+        }
+    }
+public:
+    Recorder(const std::string & path, std::vector<Field> fields, unsigned stride, std::vector<arb_index_type> cvs, size_t capacity) :
+        fields(std::move(fields)), stride(std::max(stride, 1u)), cvs(std::move(cvs)), capacity(std::max<size_t>(capacity, 1))
+    {
+        out = std::fopen(path.c_str(), "wb");
+        if (!out) ERROR("can not open recording for writing");
+        std::sort(this->cvs.begin(), this->cvs.end());
+        writer = std::thread([this]{ write_loop(); });
+    }
+    Recorder(const Recorder &) = delete;
+    ~Recorder() { close(); }
+    void sample(arb_mechanism_ppack * pp) {
+        Stream * stream;
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex);
+            auto & entry = streams[pp];
+            if (entry && (entry->width != pp->width || entry->node_index != pp->node_index)) {
+                flush(*entry);
+                entry.reset();
+            }
+            if (!entry) {
+                entry = std::make_unique<Stream>();
+                entry->id = next_id++;
+                entry->width = pp->width;
+                entry->node_index = pp->node_index;
+                for (size_t k = 0; k < pp->width; k++) {
+                    if (cvs.empty() || std::binary_search(cvs.begin(), cvs.end(), pp->node_index[k])) entry->instances.push_back(k);
+                }
+                entry->cols = 1 + fields.size()*entry->instances.size();
+                entry->buf.reserve(capacity*entry->cols);
+                header(*entry, pp);
+            }
+            stream = entry.get();
+        }
+        // one thread advances a ppack at a time, so the stream is ours
+        auto step = stream->step++;
+        if (step % stride) return;
+        stream->buf.push_back(step);
+        for (auto & f : fields) {
+            const arb_index_type * index;
+            auto src = source(f, pp, index);
+            for (auto k : stream->instances) stream->buf.push_back(src ? src[index ? index[k] : k] : NAN);
+        }
+        if (stream->buf.size() >= capacity*stream->cols) flush(*stream);
+    }
+    // pp was (re)initialised: its samples go to a new stream from now on
+    void forget(arb_mechanism_ppack * pp) {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        auto it = streams.find(pp);
+        if (it == streams.end()) return;
+        flush(*it->second);
+        streams.erase(it);
+    }
+    void close() {
+        if (!out) return;
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex);
+            for (auto & entry : streams) flush(*entry.second);
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_cv.notify_one();
+        writer.join();
+        std::fclose(out);
+        out = nullptr;
+    }
 };
 
 class ArbMech {
@@ -175,20 +665,79 @@ class ArbMech {
     }
 public:
     std::string name = "mech";
+    std::string fingerprint = "<placeholder>";
     arb_mechanism_kind kind = arb_mechanism_kind_density;
     bool is_linear = false;
     bool has_post_events = false;
+    // SIMD layout requested from arbor: state/parameter rows are padded to a
+    // multiple of partition_width and start on alignment byte boundaries
+    arb_size_type partition_width = 1;
+    arb_size_type alignment = 8;
+    arb_mechanism_interface iface;
+    // index into the trampoline table, set on register
+    int slot = -1;
+    // python callbacks only every update_every steps, see PP::slow_step
+    unsigned update_every = 1;
+    bool extrapolate = false;
+    // python sees float32 copies, see PP::to_float32
+    bool float32 = false;
+    // outputs of compute_currents/write_ions only change when marked dirty,
+    // see PP::skip_currents
+    bool constant_currents = false;
+    bool constant_ions = false;
+    bool caches_currents() const { return update_every > 1 || constant_currents; }
+    bool caches_ions() const { return update_every > 1 || constant_ions; }
     std::vector<arb_field_info> globals;
     std::vector<arb_ion_info> ions;
     std::vector<arb_field_info> state_vars;
     std::vector<arb_field_info> parameters;
     std::vector<arb_random_variable_info> random_variables;
-    std::function<void(const PP pp)> init_handler;
-    std::function<void(const PP pp)> advance_state_handler;
-    std::function<void(const PP pp)> compute_currents_handler;
-    std::function<void(const PP pp)> write_ions_handler;
-    ArbMech() {
-        add_global("_arbor_pycat_mech_idx", "1", 123456789.); // to be updated on register
+    py::function init_handler;
+    py::function advance_state_handler;
+    py::function compute_currents_handler;
+    py::function write_ions_handler;
+    // fused mode: one python call per timestep, see PP::stage
+    py::function step_handler;
+    py::function apply_events_handler;
+    py::function post_event_handler;
+    RateTables rates;
+    // raw C kernels (numba cfunc, ctypes, user .so); when set they are called
+    // directly with the ppack, without PP, numpy or the GIL
+    arb_mechanism_method init_native = nullptr;
+    arb_mechanism_method advance_state_native = nullptr;
+    arb_mechanism_method compute_currents_native = nullptr;
+    arb_mechanism_method write_ions_native = nullptr;
+    arb_mechanism_method_events apply_events_native = nullptr;
+    arb_mechanism_method post_event_native = nullptr;
+    // persistent PP per ppack; created with the GIL held, looked up without
+    std::unordered_map<arb_mechanism_ppack*, std::pair<py::object, PP*>> views;
+    std::mutex views_mutex;
+    std::array<CallStats, n_callbacks> stats;
+    std::mutex stats_mutex;
+    std::shared_ptr<Recorder> recorder;
+    // every ppack arbor initialised, python or not, with the init round it
+    // was last initialised in; for checkpoints
+    std::vector<std::pair<arb_mechanism_ppack*, uint64_t>> ppacks;
+    // GIL held: forget the ppacks of a deleted simulation
+    void drop_round(uint64_t round) {
+        std::lock_guard<std::mutex> lock(views_mutex);
+        auto end = std::remove_if(ppacks.begin(), ppacks.end(), [&](auto & entry) {
+            if (entry.second != round) return false;
+            views.erase(entry.first);
+            return true;
+        });
+        ppacks.erase(end, ppacks.end());
+    }
+    void begin_init(arb_mechanism_ppack * pp, uint64_t round) {
+        // GIL held: drops python objects. The view of this ppack is rebuilt
+        // on first use whatever init does. Other views are kept, their
+        // simulations may still be running; one left by a deleted
+        // simulation goes once the allocator hands its address out again
+        std::lock_guard<std::mutex> lock(views_mutex);
+        views.erase(pp);
+        auto it = std::find_if(ppacks.begin(), ppacks.end(), [&](auto & entry) { return entry.first == pp; });
+        if (it == ppacks.end()) ppacks.emplace_back(pp, round);
+        else it->second = round;
     }
     int add_global(const std::string & name, const std::string & unit = "", double default_value=0.) {
         frozen_check();
@@ -238,126 +787,973 @@ public:
         ions.push_back(aii);
         return ions.size() - 1;
     }
+    std::pair<py::object, PP*> & view(arb_mechanism_ppack * pp, bool rebuild=false) {
+        std::lock_guard<std::mutex> lock(views_mutex);
+        auto & entry = views[pp];
+        if (rebuild || !entry.second || !entry.second->wraps(pp)) {
+            entry.second = new PP(pp, this);
+            entry.first = py::cast(entry.second, py::return_value_policy::take_ownership);
+        }
+        return entry;
+    }
+    PP * find_view(arb_mechanism_ppack * pp) {
+        std::lock_guard<std::mutex> lock(views_mutex);
+        auto it = views.find(pp);
+        if (it == views.end() || !it->second.second->wraps(pp)) return nullptr;
+        return it->second.second;
+    }
+    void mark_dirty() {
+        std::lock_guard<std::mutex> lock(views_mutex);
+        for (auto & entry : views) if (entry.second.second) entry.second.second->mark_dirty();
+    }
 };
 
+PP::PP(arb_mechanism_ppack* pp, ArbMech * mech) :
+    pp(pp), mech(mech),
+    width(pp->width), node_index_raw(pp->node_index), vec_v_raw(pp->vec_v), state_vars_raw(pp->state_vars),
+    state_views(mech->state_vars.size()),
+    param_views(mech->parameters.size()),
+    random_views(mech->random_variables.size()),
+    state_padded_views(mech->state_vars.size()),
+    param_padded_views(mech->parameters.size())
+{
+    int maxidx = 0;
+    for (size_t i = 0; i < pp->width; i++) {
+        if (pp->node_index[i] > maxidx) {
+            maxidx = pp->node_index[i];
+        }
+    }
+    max_node_index = maxidx;
+    bool contiguous = true;
+    node_offset = pp->width ? pp->node_index[0] : 0;
+    for (size_t i = 0; i < pp->width && contiguous; i++) {
+        contiguous = pp->node_index[i] == node_offset + (arb_index_type)i;
+    }
+    if (contiguous) layout = node_offset == 0 ? NodeLayout::identity : NodeLayout::contiguous;
+    auto row_stride = [&](arb_value_type ** rows, size_t n) -> int64_t {
+        if (n <= 1) return pp->width;
+        int64_t stride = rows[1] - rows[0];
+        for (size_t r = 1; r < n; r++) {
+            if (rows[r] - rows[r-1] != stride) return -1;
+        }
+        return stride >= (int64_t)pp->width ? stride : -1;
+    };
+    if (pp->state_vars) state_stride = row_stride(pp->state_vars, mech->state_vars.size());
+    if (pp->parameters) param_stride = row_stride(pp->parameters, mech->parameters.size());
+    // only trust a padding we can see: the spacing between two rows
+    int64_t spacing = std::numeric_limits<int64_t>::max();
+    if (mech->state_vars.size() > 1 && state_stride > 0) spacing = state_stride;
+    if (mech->parameters.size() > 1 && param_stride > 0) spacing = std::min(spacing, param_stride);
+    padded_width = spacing == std::numeric_limits<int64_t>::max() ? (ssize_t)pp->width : (ssize_t)spacing;
+    if (pp->vec_ci) {
+        for (size_t i = 0; i < pp->width; i++) {
+            n_cells = std::max(n_cells, pp->vec_ci[pp->node_index[i]] + 1);
+        }
+    }
+    if (pp->ion_states) {
+        for (size_t i = 0; i < mech->ions.size(); i++) {
+            ion_states.emplace_back(get_width(), &pp->ion_states[i]);
+        }
+    }
+    if (mech->caches_currents() || mech->caches_ions()) {
+        sub.i.reset(pp->node_index, width);
+        sub.g = sub.i;
+        for (auto list : {&sub.ion_i, &sub.ion_g, &sub.ion_xi, &sub.ion_xo, &sub.ion_erev}) {
+            list->resize(ion_states.size());
+            for (size_t q = 0; q < ion_states.size(); q++) (*list)[q].reset(ion_states[q].raw->index, width);
+        }
+    }
+}
+
 py::array_t<arb_value_type> PP::state(size_t idx) {
     if (!pp->state_vars) ERROR("empty state_vars");
     if (idx >= mech->state_vars.size()) ERROR("state out of range");
-    return ArbPPArray<arb_value_type>(get_width(), pp->state_vars[idx]).to_numpy(); }
+    return cached_view(state_views.at(idx), get_width(), pp->state_vars[idx]); }
 py::array_t<arb_value_type> PP::param(size_t idx) {
     if (!pp->parameters) ERROR("empty parameters");
     if (idx >= mech->parameters.size()) ERROR("param out of range");
-    return ArbPPArray<arb_value_type>(get_width(), pp->parameters[idx]).to_numpy(); }
+    return cached_view(param_views.at(idx), get_width(), pp->parameters[idx]); }
+py::array_t<arb_value_type> PP::state_padded(size_t idx) {
+    if (!pp->state_vars) ERROR("empty state_vars");
+    if (idx >= mech->state_vars.size()) ERROR("state out of range");
+    return cached_view(state_padded_views.at(idx), padded_width, pp->state_vars[idx]); }
+py::array_t<arb_value_type> PP::param_padded(size_t idx) {
+    if (!pp->parameters) ERROR("empty parameters");
+    if (idx >= mech->parameters.size()) ERROR("param out of range");
+    return cached_view(param_padded_views.at(idx), padded_width, pp->parameters[idx]); }
 py::array_t<arb_value_type> PP::random(size_t idx) {
     if (!pp->random_numbers) ERROR("empty random");
     if (idx >= mech->random_variables.size()) ERROR("param out of range");
     // ugly: we discard the const
-    return ArbPPArray<arb_value_type>(get_width(), (arb_value_type*)pp->random_numbers[idx], true).to_numpy(); }
-ArbIonState PP::ions(size_t idx) {
+    return cached_view(random_views.at(idx), get_width(), (arb_value_type*)pp->random_numbers[idx]); }
+ArbIonState & PP::ions(size_t idx) {
     if (!pp->ion_states) ERROR("empty ion_states");
     if (idx >= mech->ions.size()) ERROR("param out of range");
-    return ArbIonState(get_width(), &pp->ion_states[idx]); }
+    return ion_states.at(idx); }
 
-void PP::set_state(py::array_t<arb_value_type> & states) {
+py::array_t<arb_value_type> PP::local(py::object & slot, LocalGather & buf, arb_value_type * src) {
+    if (layout != NodeLayout::general) return cached_view(slot, get_width(), src + node_offset);
+    if (!buf.array) {
+        auto array = py::array_t<arb_value_type>(get_width());
+        buf.data = array.mutable_data();
+        buf.array = array;
+        buf.orig.resize(width);
+    }
+    if (!buf.active) {
+        for (size_t k = 0; k < width; k++) buf.data[k] = buf.orig[k] = src[pp->node_index[k]];
+        buf.active = true;
+    }
+    return py::reinterpret_borrow<py::array_t<arb_value_type>>(buf.array);
+}
+void PP::to_float32() {
+    // plain loops, vectorized by the compiler. Sizes never change for a
+    // ppack, so the cached views into these vectors stay valid
+    size_t n_state = pp->state_vars ? mech->state_vars.size() : 0;
+    size_t n_param = pp->parameters ? mech->parameters.size() : 0;
+    f32.v.resize(width);
+    f32.i.assign(width, 0.f);
+    f32.g.assign(width, 0.f);
+    f32.state.resize(n_state*width);
+    f32.state0.resize(n_state*width);
+    f32.param.resize(n_param*width);
+    for (size_t k = 0; k < width; k++) f32.v[k] = pp->vec_v[pp->node_index[k]];
+    for (size_t r = 0; r < n_state; r++) {
+        auto src = pp->state_vars[r];
+        auto dst = f32.state.data() + r*width;
+        for (size_t k = 0; k < width; k++) dst[k] = src[k];
+    }
+    std::copy(f32.state.begin(), f32.state.end(), f32.state0.begin());
+    for (size_t r = 0; r < n_param; r++) {
+        auto src = pp->parameters[r];
+        auto dst = f32.param.data() + r*width;
+        for (size_t k = 0; k < width; k++) dst[k] = src[k];
+    }
+}
+void PP::from_float32() {
+    // add the change made in single precision, so the double state keeps
+    // its own rounding instead of being truncated to float every step
+    for (size_t r = 0; r*width < f32.state.size(); r++) {
+        auto dst = pp->state_vars[r];
+        auto now = f32.state.data() + r*width;
+        auto before = f32.state0.data() + r*width;
+        for (size_t k = 0; k < width; k++) dst[k] += (arb_value_type)now[k] - (arb_value_type)before[k];
+    }
+    for (size_t k = 0; k < width; k++) {
+        pp->vec_i[pp->node_index[k]] += f32.i[k];
+        pp->vec_g[pp->node_index[k]] += f32.g[k];
+    }
+}
+py::object PP::states32() {
+    if (!f32.states_view) f32.states_view = py::array_t<float>({(ssize_t)(f32.state.size()/std::max<size_t>(width, 1)), get_width()}, f32.state.data(), py::none());
+    return f32.states_view;
+}
+py::object PP::params32() {
+    if (!f32.params_view) f32.params_view = py::array_t<float>({(ssize_t)(f32.param.size()/std::max<size_t>(width, 1)), get_width()}, f32.param.data(), py::none());
+    return f32.params_view;
+}
+py::array_t<float> PP::state32(size_t idx) {
+    if (idx*width >= f32.state.size()) ERROR("state out of range");
+    f32.state_rows.resize(mech->state_vars.size());
+    return cached_view(f32.state_rows.at(idx), get_width(), f32.state.data() + idx*width);
+}
+py::array_t<float> PP::param32(size_t idx) {
+    if (idx*width >= f32.param.size()) ERROR("param out of range");
+    f32.param_rows.resize(mech->parameters.size());
+    return cached_view(f32.param_rows.at(idx), get_width(), f32.param.data() + idx*width);
+}
+void PP::scatter_local() {
+    auto scatter = [&](LocalGather & buf, arb_value_type * dst) {
+        if (!buf.active) return;
+        for (size_t k = 0; k < width; k++) dst[pp->node_index[k]] += buf.data[k] - buf.orig[k];
+        buf.active = false;
+    };
+    scatter(v_gather, pp->vec_v);
+    scatter(i_gather, pp->vec_i);
+    scatter(g_gather, pp->vec_g);
+}
+ArbDLArray PP::states_dlarray() {
     if (!pp->state_vars) ERROR("empty state_vars");
-    py::buffer_info info = states.request();
-    if (info.ndim != 2) ERROR("set_state input must be 2d");
-    for (int i = 0; i < info.shape[0]; i++) {
-        state(i)[py::ellipsis()] = states[py::make_tuple(i, py::ellipsis())];
+    if (state_stride < 0) ERROR("state rows are not equally spaced, use get_state");
+    return ArbDLArray(pp->state_vars[0], {(int64_t)mech->state_vars.size(), (int64_t)width}, {state_stride, 1});
+}
+ArbDLArray PP::params_dlarray() {
+    if (!pp->parameters) ERROR("empty parameters");
+    if (param_stride < 0) ERROR("parameter rows are not equally spaced");
+    return ArbDLArray(pp->parameters[0], {(int64_t)mech->parameters.size(), (int64_t)width}, {param_stride, 1});
+}
+ArbDLArray PP::dlarray(const std::string & name) {
+    if (name == "state") return states_dlarray();
+    if (name == "param") return params_dlarray();
+    if (name == "node_index") return ArbDLArray(pp->node_index, {(int64_t)width}, {1});
+    if (name == "v") return ArbDLArray(pp->vec_v, {get_nwidth()}, {1});
+    if (name == "i") return ArbDLArray(pp->vec_i, {get_nwidth()}, {1});
+    if (name == "g") return ArbDLArray(pp->vec_g, {get_nwidth()}, {1});
+    ERROR("unknown dlpack array, expected state, param, node_index, v, i or g");
+}
+void PP::set_state(py::array_t<arb_value_type, py::array::c_style | py::array::forcecast> & states) {
+    if (!pp->state_vars) ERROR("empty state_vars");
+    if (states.ndim() != 2) ERROR("set_state input must be 2d");
+    if ((size_t)states.shape(0) > mech->state_vars.size() || states.shape(1) != get_width()) ERROR("set_state input has wrong shape");
+    for (ssize_t i = 0; i < states.shape(0); i++) {
+        std::memcpy(pp->state_vars[i], states.data() + i*width, width*sizeof(arb_value_type));
     }
 }
+void PP::set_state_from_dlpack(py::object obj) {
+    if (!pp->state_vars) ERROR("empty state_vars");
+    py::object capsule = py::hasattr(obj, "__dlpack__") ? obj.attr("__dlpack__")() : obj;
+    if (!PyCapsule_IsValid(capsule.ptr(), "dltensor")) ERROR("expected a dlpack capsule or an object with __dlpack__");
+    auto managed = (DLManagedTensor*)PyCapsule_GetPointer(capsule.ptr(), "dltensor");
+    PyCapsule_SetName(capsule.ptr(), "used_dltensor");
+    std::unique_ptr<DLManagedTensor, void(*)(DLManagedTensor*)> owned(managed, [](DLManagedTensor * m) {
+        if (m->deleter) m->deleter(m);
+    });
+    auto & t = managed->dl_tensor;
+    if (t.device.device_type != kDLCPU) ERROR("dlpack tensor must live on the cpu");
+    if (t.dtype.code != kDLFloat || (t.dtype.bits != 64 && t.dtype.bits != 32) || t.dtype.lanes != 1) ERROR("dlpack tensor must be float64 or float32");
+    if (t.ndim != 2 || t.shape[0] != (int64_t)mech->state_vars.size() || t.shape[1] != (int64_t)width) ERROR("dlpack tensor must have shape [n_state, width]");
+    int64_t row = t.strides ? t.strides[0] : t.shape[1];
+    int64_t col = t.strides ? t.strides[1] : 1;
+    auto copy = [&](auto src) {
+        for (size_t s = 0; s < mech->state_vars.size(); s++) {
+            auto dst = pp->state_vars[s];
+            auto from = src + s*row;
+            if ((void*)from == (void*)dst && col == 1) continue; // already in place, e.g. our own state view
+            if (sizeof(*from) == sizeof(*dst) && col == 1) {
+                std::memmove(dst, from, width*sizeof(arb_value_type));
+            } else {
+                for (size_t k = 0; k < width; k++) dst[k] = from[k*col];
+            }
+        }
+    };
+    auto data = (const char*)t.data + t.byte_offset;
+    if (t.dtype.bits == 64) copy((const arb_value_type*)data);
+    else copy((const float*)data);
+}
 py::array_t<arb_value_type> PP::get_state() {
     if (!pp->state_vars) ERROR("empty state_vars");
-    std::vector<py::array_t<arb_value_type>> states;
+    py::array_t<arb_value_type> res({(ssize_t)mech->state_vars.size(), get_width()});
     for (size_t i = 0; i < mech->state_vars.size(); i++) {
-        states.push_back(state(i));
+        std::memcpy(res.mutable_data() + i*width, pp->state_vars[i], width*sizeof(arb_value_type));
     }
-    return stack<arb_value_type>(states);
+    return res;
 }
-py::array_t<arb_value_type> PP::get_diff_ions() {
-    if (!pp->state_vars) ERROR("empty state_vars");
-    py::array_t<arb_value_type, py::array::f_style> res({(int)mech->ions.size(), (int)get_width()});
+PP::IonField PP::ion_field(const std::string & name) {
+    if (name == "i") return ion_i;
+    if (name == "g") return ion_g;
+    if (name == "erev") return ion_erev;
+    if (name == "xi") return ion_xi;
+    if (name == "xo") return ion_xo;
+    if (name == "xd") return ion_xd;
+    ERROR("unknown ion field, expected i, g, erev, xi, xo or xd");
+}
+arb_value_type * PP::ion_field_data(arb_ion_state & s, IonField f) {
+    switch (f) {
+        case ion_i: return s.current_density;
+        case ion_g: return s.conductivity;
+        case ion_erev: return s.reversal_potential;
+        case ion_xi: return s.internal_concentration;
+        case ion_xo: return s.external_concentration;
+        case ion_xd: return s.diffusive_concentration;
+        default: return nullptr;
+    }
+}
+py::array_t<arb_value_type> PP::gather_ions(const std::string & name) {
+    if (!pp->ion_states) ERROR("empty ion_states");
+    auto f = ion_field(name);
+    auto & slot = ion_gathers[f];
+    if (!slot) slot = py::array_t<arb_value_type>({(ssize_t)mech->ions.size(), get_width()});
+    auto res = py::reinterpret_borrow<py::array_t<arb_value_type>>(slot);
+    auto out = res.mutable_data();
     for (size_t i = 0; i < mech->ions.size(); i++) {
-        auto s = ions(i);
-        auto d =  ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->diffusive_concentration).to_numpy();
-        auto idx = ArbPPArray<arb_index_type>(s.size_of_index_array, s.raw->index).to_numpy();
-        res[py::make_tuple(i, py::ellipsis())] = d[idx];
+        auto & s = pp->ion_states[i];
+        auto src = ion_field_data(s, f);
+        if (!src) ERROR("ion field not provided by arbor");
+        for (size_t k = 0; k < width; k++) out[i*width + k] = src[s.index[k]];
     }
     return res;
 }
-void PP::set_diff_ions(py::array_t<arb_value_type> & val) {
-    if (!pp->state_vars) ERROR("empty state_vars");
-    py::buffer_info info = val.request();
-    if (info.ndim != 2) ERROR("set_diff_ions input must be 2d");
+void PP::scatter_ions(const std::string & name, py::array_t<arb_value_type, py::array::c_style | py::array::forcecast> & val, bool accumulate) {
+    if (!pp->ion_states) ERROR("empty ion_states");
+    auto f = ion_field(name);
+    if (val.ndim() != 2 || val.shape(0) != (ssize_t)mech->ions.size() || val.shape(1) != get_width()) ERROR("scatter_ions input must have shape [n_ions, width]");
+    auto in = val.data();
     for (size_t i = 0; i < mech->ions.size(); i++) {
-        auto s = ions(i);
-        auto d =  ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->diffusive_concentration).to_numpy();
-        auto idx = ArbPPArray<arb_index_type>(s.size_of_index_array, s.raw->index).to_numpy();
-        d[idx] = val[py::make_tuple(i, py::ellipsis())];
+        auto & s = pp->ion_states[i];
+        auto dst = ion_field_data(s, f);
+        if (!dst) ERROR("ion field not provided by arbor");
+        if (accumulate) {
+            for (size_t k = 0; k < width; k++) dst[s.index[k]] += in[i*width + k];
+        } else {
+            for (size_t k = 0; k < width; k++) dst[s.index[k]] = in[i*width + k];
+        }
+    }
+}
+
+void PP::stage(py::handle result) {
+    if (result.is_none()) return;
+    if (!py::isinstance<py::dict>(result)) ERROR("fused step must return a dict or None");
+    auto out = py::reinterpret_borrow<py::dict>(result);
+    auto get = [&](const char * key, size_t rows, std::vector<arb_value_type> & dst) {
+        if (!out.contains(key)) return;
+        py::object val = out[key];
+        auto arr = py::array_t<arb_value_type, py::array::c_style | py::array::forcecast>::ensure(val);
+        if (!arr || (size_t)arr.size() != rows * width) ERROR("fused step output has wrong size");
+        dst.assign(arr.data(), arr.data() + arr.size());
+    };
+    std::vector<arb_value_type> state;
+    get("state", mech->state_vars.size(), state);
+    for (size_t s = 0; !state.empty() && s < mech->state_vars.size(); s++) {
+        std::copy(state.begin() + s*width, state.begin() + (s+1)*width, pp->state_vars[s]);
+    }
+    get("i", 1, staged.i);
+    get("g", 1, staged.g);
+    get("ion_i", ion_states.size(), staged.ion_i);
+    get("ion_g", ion_states.size(), staged.ion_g);
+    get("ion_xi", ion_states.size(), staged.ion_xi);
+    get("ion_xo", ion_states.size(), staged.ion_xo);
+    get("ion_erev", ion_states.size(), staged.ion_erev);
+}
+void PP::apply_staged_currents() {
+    auto add = [&](const std::vector<arb_value_type> & src, arb_value_type * dst, arb_index_type * index, size_t offset) {
+        if (src.empty()) return;
+        for (size_t k = 0; k < width; k++) dst[index[k]] += src[offset + k];
+    };
+    add(staged.i, pp->vec_i, pp->node_index, 0);
+    add(staged.g, pp->vec_g, pp->node_index, 0);
+    for (size_t q = 0; q < ion_states.size(); q++) {
+        auto raw = ion_states[q].raw;
+        add(staged.ion_i, raw->current_density, raw->index, q*width);
+        add(staged.ion_g, raw->conductivity, raw->index, q*width);
+    }
+}
+void PP::apply_staged_ions() {
+    auto set = [&](const std::vector<arb_value_type> & src, arb_value_type * dst, arb_index_type * index, size_t offset) {
+        if (src.empty()) return;
+        for (size_t k = 0; k < width; k++) dst[index[k]] = src[offset + k];
+    };
+    for (size_t q = 0; q < ion_states.size(); q++) {
+        auto raw = ion_states[q].raw;
+        set(staged.ion_xi, raw->internal_concentration, raw->index, q*width);
+        set(staged.ion_xo, raw->external_concentration, raw->index, q*width);
+        set(staged.ion_erev, raw->reversal_potential, raw->index, q*width);
+    }
+}
+
+bool PP::slow_step(bool after_advance) const {
+    // nothing is recorded before the first advance_state, e.g. when arbor
+    // calls write_ions while resetting, so python runs and is recorded
+    if (sub.step == 0) return true;
+    // write_ions runs after advance_state has moved the counter on
+    return (sub.step - after_advance) % mech->update_every == 0;
+}
+bool PP::skip_currents() const {
+    return (mech->update_every > 1 && !slow_step()) || (mech->constant_currents && !dirty.currents);
+}
+bool PP::skip_ions() const {
+    return (mech->update_every > 1 && !slow_step(true)) || (mech->constant_ions && !dirty.ions);
+}
+void PP::begin_currents() {
+    // cleared before the call, so python can ask to be called next step too
+    dirty.currents = false;
+    sub.i.snapshot(pp->vec_i);
+    sub.g.snapshot(pp->vec_g);
+    for (size_t q = 0; q < ion_states.size(); q++) {
+        sub.ion_i[q].snapshot(ion_states[q].raw->current_density);
+        sub.ion_g[q].snapshot(ion_states[q].raw->conductivity);
+    }
+}
+void PP::end_currents() {
+    sub.i.delta(pp->vec_i);
+    sub.g.delta(pp->vec_g);
+    for (size_t q = 0; q < ion_states.size(); q++) {
+        sub.ion_i[q].delta(ion_states[q].raw->current_density);
+        sub.ion_g[q].delta(ion_states[q].raw->conductivity);
+    }
+}
+void PP::replay_currents() const {
+    sub.i.add(pp->vec_i);
+    sub.g.add(pp->vec_g);
+    for (size_t q = 0; q < ion_states.size(); q++) {
+        sub.ion_i[q].add(ion_states[q].raw->current_density);
+        sub.ion_g[q].add(ion_states[q].raw->conductivity);
+    }
+}
+void PP::end_ions() {
+    for (size_t q = 0; q < ion_states.size(); q++) {
+        auto & info = mech->ions[q];
+        auto raw = ion_states[q].raw;
+        if (info.write_int_concentration) sub.ion_xi[q].record(raw->internal_concentration);
+        if (info.write_ext_concentration) sub.ion_xo[q].record(raw->external_concentration);
+        if (info.write_rev_potential) sub.ion_erev[q].record(raw->reversal_potential);
+    }
+}
+void PP::replay_ions() const {
+    for (size_t q = 0; q < ion_states.size(); q++) {
+        auto & info = mech->ions[q];
+        auto raw = ion_states[q].raw;
+        if (info.write_int_concentration) sub.ion_xi[q].assign(raw->internal_concentration);
+        if (info.write_ext_concentration) sub.ion_xo[q].assign(raw->external_concentration);
+        if (info.write_rev_potential) sub.ion_erev[q].assign(raw->reversal_potential);
+    }
+}
+void PP::begin_state() {
+    if (!mech->extrapolate || !pp->state_vars) return;
+    sub.state0.resize(mech->state_vars.size()*width);
+    for (size_t r = 0; r < mech->state_vars.size(); r++) {
+        std::memcpy(sub.state0.data() + r*width, pp->state_vars[r], width*sizeof(arb_value_type));
+    }
+}
+void PP::end_state() {
+    // spread the jump over the window: keep one step of it now, the rest
+    // is added back by replay_state
+    if (!mech->extrapolate || !pp->state_vars) return;
+    sub.slope.resize(sub.state0.size());
+    for (size_t r = 0; r < mech->state_vars.size(); r++) {
+        auto row = pp->state_vars[r];
+        for (size_t k = 0; k < width; k++) {
+            auto & s0 = sub.state0[r*width + k];
+            auto & slope = sub.slope[r*width + k];
+            slope = (row[k] - s0)/mech->update_every;
+            row[k] = s0 + slope;
+        }
+    }
+}
+void PP::replay_state() {
+    if (!mech->extrapolate || sub.slope.empty()) return;
+    for (size_t r = 0; r < mech->state_vars.size(); r++) {
+        auto row = pp->state_vars[r];
+        for (size_t k = 0; k < width; k++) row[k] += sub.slope[r*width + k];
+    }
+}
+
+void RateTables::tabulate() {
+    if (!enabled()) return;
+    if (n < 2 || !(vmax > vmin)) ERROR("rate table needs vmin < vmax and at least 2 points");
+    scale = (n - 1)/(vmax - vmin);
+    py::array_t<arb_value_type> v((ssize_t)n);
+    auto vs = v.mutable_data();
+    for (size_t k = 0; k < n; k++) vs[k] = vmin + k/scale;
+    auto eval = [&](py::function & fn, std::vector<arb_value_type> & dst) {
+        auto res = py::array_t<arb_value_type, py::array::c_style | py::array::forcecast>::ensure(fn(v));
+        if (!res || (size_t)res.size() != n) ERROR("rate function must return one value per voltage");
+        dst.assign(res.data(), res.data() + n);
+    };
+    for (auto & gate : gates) {
+        eval(gate.alpha_fn, gate.alpha);
+        eval(gate.beta_fn, gate.beta);
+    }
+}
+void RateTables::init(arb_mechanism_ppack * pp) const {
+    for (auto & gate : gates) {
+        auto x = pp->state_vars[gate.state];
+        for (size_t k = 0; k < pp->width; k++) {
+            arb_value_type a, b;
+            lookup(gate, pp->vec_v[pp->node_index[k]], a, b);
+            x[k] = a/(a + b);
+        }
+    }
+}
+void RateTables::advance_state(arb_mechanism_ppack * pp) const {
+    // exponential euler (cnexp): x -> x_inf + (x - x_inf)*exp(-dt/tau)
+    for (auto & gate : gates) {
+        auto x = pp->state_vars[gate.state];
+        for (size_t k = 0; k < pp->width; k++) {
+            arb_value_type a, b;
+            lookup(gate, pp->vec_v[pp->node_index[k]], a, b);
+            arb_value_type x_inf = a/(a + b);
+            x[k] = x_inf + (x[k] - x_inf)*std::exp(-pp->dt*(a + b));
+        }
+    }
+}
+void RateTables::compute_currents(arb_mechanism_ppack * pp) const {
+    // same units as NMODL: conductances in S/cm2, scaled by the CV weight
+    for (size_t k = 0; k < pp->width; k++) {
+        auto node = pp->node_index[k];
+        arb_value_type v = pp->vec_v[node];
+        arb_value_type i = 0, g_total = 0;
+        for (auto & current : currents) {
+            arb_value_type g = pp->parameters[current.gbar][k];
+            for (auto & power : current.powers) {
+                for (int p = 0; p < power.second; p++) g *= pp->state_vars[power.first][k];
+            }
+            i += g*(v - pp->parameters[current.erev][k]);
+            g_total += g;
+        }
+        arb_value_type w = 10*pp->weight[k];
+        pp->vec_i[node] += w*i;
+        pp->vec_g[node] += w*g_total;
     }
 }
 
 std::vector<std::shared_ptr<ArbMech>> mechs;
 
-static void init(arb_mechanism_ppack* pp) {
-    // i have absolutely NO idea why, but mechanism_id's are assigned
-    // in reverse order??
-    // Ah so we can not actuall use this it's 
-    //   "Unique ID for this mechanism on this cell group"
-    // So we need to store in a global I assme
-    // int idx = mechs.size() - pp->mechanism_id - 1;
-    int idx = (int)pp->globals[0];
-    mechs.at(idx)->init_handler(PP(pp, mechs.at(idx)));
+// Arbor initialises every ppack of a simulation before stepping any, so the
+// first init after a step starts a new round: a new simulation or a reset.
+// Rounds tag ppacks, they never invalidate the data of other ppacks.
+// arbor_pycat.simulation instead gives each simulation its own round, set
+// while it initialises, and drops the round when it is deleted: only ppacks
+// of live_rounds are known to be alive
+std::mutex init_mutex;
+uint64_t init_round = 0;
+uint64_t forced_round = 0; // 0: none
+std::set<uint64_t> live_rounds;
+std::atomic<bool> stepped{false};
+
+class Checkpoint {
+    // Binary snapshot of state, parameters and diffusive concentrations.
+    // One block per (mechanism, cell); the ABI has no gids, so a cell is
+    // identified by a hash of its instances' CV offsets (relative to its
+    // first instance), CV areas and parameters. Blocks thus match the same
+    // cells on restart however cells are grouped. Cells that share a hash,
+    // in the file or in the new simulation, are not restored: telling them
+    // apart takes a parameter, e.g. the gid. Instance data is stored
+    // row-major, [n, width] with width the instances on the cell.
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_blocks;
+    };
+    struct Block {
+        char name[64];
+        uint64_t signature;
+        uint64_t size; // bytes, this header included
+        uint32_t width, n_state, n_param, n_ions;
+    };
+    static constexpr const char * magic = "APYCKPT";
+    static constexpr uint32_t version = 3;
+    static size_t payload(const ArbMech & mech, size_t width) {
+        return (mech.state_vars.size() + mech.parameters.size() + mech.ions.size())*width*sizeof(arb_value_type);
+    }
+    struct Mapping {
+        void * data = MAP_FAILED;
+        size_t size = 0;
+        ~Mapping() { if (data != MAP_FAILED) munmap(data, size); }
+    };
+    Mapping map;
+    // restore: blocks by (name, signature); a key is consumed once
+    std::unordered_map<std::string, std::vector<const Block*>> blocks;
+    std::unordered_set<std::string> consumed;
+    size_t ambiguous_cells = 0;
+    std::mutex mutex;
+    static std::string key(const char * name, uint64_t signature) {
+        return std::string(name) + "/" + std::to_string(signature);
+    }
+    // instance indices of each cell in pp, cells in order of appearance
+    static std::vector<std::vector<size_t>> cells(const arb_mechanism_ppack * pp) {
+        std::vector<std::vector<size_t>> res;
+        std::unordered_map<arb_index_type, size_t> slot;
+        for (size_t k = 0; k < pp->width; k++) {
+            auto cell = pp->vec_ci ? pp->vec_ci[pp->node_index[k]] : 0;
+            auto it = slot.emplace(cell, res.size()).first;
+            if (it->second == res.size()) res.emplace_back();
+            res[it->second].push_back(k);
+        }
+        return res;
+    }
+    static uint64_t signature(const ArbMech & mech, const arb_mechanism_ppack * pp, const std::vector<size_t> & instances) {
+        uint64_t h = 1469598103934665603ull; // FNV-1a
+        auto mix = [&](const void * p, size_t n) {
+            for (size_t k = 0; k < n; k++) { h ^= ((const unsigned char*)p)[k]; h *= 1099511628211ull; }
+        };
+        uint64_t n = instances.size();
+        mix(&n, sizeof(n));
+        for (auto k : instances) {
+            auto node = pp->node_index[k];
+            arb_index_type offset = node - pp->node_index[instances[0]];
+            mix(&offset, sizeof(offset));
+            if (pp->area_um2) mix(&pp->area_um2[node], sizeof(*pp->area_um2));
+            for (size_t r = 0; pp->parameters && r < mech.parameters.size(); r++) {
+                mix(&pp->parameters[r][k], sizeof(arb_value_type));
+            }
+        }
+        return h;
+    }
+public:
+    static size_t save(const std::string & path);
+    explicit Checkpoint(const std::string & path);
+    void restore(const ArbMech & mech, arb_mechanism_ppack * pp);
+    // saved cells no instance has been restored from (yet)
+    size_t unmatched() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t n = 0;
+        for (auto & entry : blocks) n += entry.second.size() == 1 && !consumed.count(entry.first);
+        return n;
+    }
+    // live cells not restored because their key was not unique
+    size_t ambiguous() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ambiguous_cells;
+    }
+};
+std::unique_ptr<Checkpoint> checkpoint;
+
+size_t Checkpoint::save(const std::string & path) {
+    // ppacks of simulations that are known to be alive, see live_rounds
+    std::set<uint64_t> rounds;
+    {
+        std::lock_guard<std::mutex> lock(init_mutex);
+        rounds = live_rounds;
+    }
+    if (rounds.empty()) ERROR("no live arbor_pycat.simulation to checkpoint");
+    std::vector<std::pair<ArbMech*, arb_mechanism_ppack*>> live;
+    for (auto & mech : mechs) {
+        std::lock_guard<std::mutex> lock(mech->views_mutex);
+        for (auto & [pp, pp_round] : mech->ppacks) {
+            if (rounds.count(pp_round)) live.emplace_back(mech.get(), pp);
+        }
+    }
+    size_t size = sizeof(Header), n_blocks = 0;
+    for (auto & [mech, pp] : live) {
+        for (auto & instances : cells(pp)) {
+            size += sizeof(Block) + payload(*mech, instances.size());
+            n_blocks += 1;
+        }
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) ERROR("can not open checkpoint for writing");
+    if (ftruncate(fd, size) != 0) { close(fd); ERROR("can not resize checkpoint"); }
+    Mapping out;
+    out.size = size;
+    out.data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (out.data == MAP_FAILED) ERROR("can not map checkpoint");
+    auto header = (Header*)out.data;
+    std::memcpy(header->magic, magic, sizeof(header->magic));
+    header->version = version;
+    header->n_blocks = n_blocks;
+    auto cursor = (char*)out.data + sizeof(Header);
+    for (auto & [mech, pp] : live) {
+        for (auto & instances : cells(pp)) {
+            auto width = instances.size();
+            auto block = (Block*)cursor;
+            std::memset(block->name, 0, sizeof(block->name));
+            std::strncpy(block->name, mech->name.c_str(), sizeof(block->name) - 1);
+            block->signature = signature(*mech, pp, instances);
+            block->size = sizeof(Block) + payload(*mech, width);
+            block->width = width;
+            block->n_state = pp->state_vars ? mech->state_vars.size() : 0;
+            block->n_param = pp->parameters ? mech->parameters.size() : 0;
+            block->n_ions = pp->ion_states ? mech->ions.size() : 0;
+            auto dst = (arb_value_type*)(block + 1);
+            for (size_t r = 0; r < block->n_state; r++, dst += width) {
+                for (size_t j = 0; j < width; j++) dst[j] = pp->state_vars[r][instances[j]];
+            }
+            for (size_t r = 0; r < block->n_param; r++, dst += width) {
+                for (size_t j = 0; j < width; j++) dst[j] = pp->parameters[r][instances[j]];
+            }
+            for (size_t q = 0; q < block->n_ions; q++, dst += width) {
+                auto & ion = pp->ion_states[q];
+                for (size_t j = 0; j < width; j++) dst[j] = ion.diffusive_concentration ? ion.diffusive_concentration[ion.index[instances[j]]] : 0;
+            }
+            cursor += block->size;
+        }
+    }
+    msync(out.data, size, MS_SYNC);
+    return n_blocks;
 }
-static void advance_state(arb_mechanism_ppack* pp) {
-    int idx = (int)pp->globals[0];
-    mechs.at(idx)->advance_state_handler(PP(pp, mechs.at(idx)));
+
+Checkpoint::Checkpoint(const std::string & path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) ERROR("can not open checkpoint");
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) { close(fd); ERROR("not a checkpoint"); }
+    map.size = st.st_size;
+    map.data = mmap(nullptr, map.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map.data == MAP_FAILED) ERROR("can not map checkpoint");
+    auto header = (const Header*)map.data;
+    if (std::memcmp(header->magic, magic, sizeof(header->magic)) != 0) ERROR("not a checkpoint");
+    if (header->version != version) ERROR("checkpoint written by another version of arbor_pycat");
+    auto cursor = (const char*)map.data + sizeof(Header);
+    auto end = (const char*)map.data + map.size;
+    for (size_t b = 0; b < header->n_blocks; b++) {
+        auto block = (const Block*)cursor;
+        if (cursor + sizeof(Block) > end || block->size < sizeof(Block) || cursor + block->size > end) ERROR("truncated checkpoint");
+        blocks[key(block->name, block->signature)].push_back(block);
+        cursor += block->size;
+    }
 }
-static void compute_currents(arb_mechanism_ppack* pp) {
-    int idx = (int)pp->globals[0];
-    mechs.at(idx)->compute_currents_handler(PP(pp, mechs.at(idx)));
+
+void Checkpoint::restore(const ArbMech & mech, arb_mechanism_ppack * pp) {
+    for (auto & instances : cells(pp)) {
+        const Block * block = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto k = key(mech.name.c_str(), signature(mech, pp, instances));
+            auto it = blocks.find(k);
+            if (it == blocks.end()) continue; // new cells start from init
+            // more than one saved or live cell with this key: any choice
+            // would be a guess, so these start from init too
+            if (it->second.size() != 1 || !consumed.insert(k).second) {
+                ambiguous_cells += 1;
+                continue;
+            }
+            block = it->second.back();
+        }
+        auto width = instances.size();
+        if (block->width != width) continue;
+        auto src = (const arb_value_type*)(block + 1);
+        for (size_t r = 0; r < block->n_state; r++, src += width) {
+            if (!pp->state_vars || r >= mech.state_vars.size()) continue;
+            for (size_t j = 0; j < width; j++) pp->state_vars[r][instances[j]] = src[j];
+        }
+        for (size_t r = 0; r < block->n_param; r++, src += width) {
+            if (!pp->parameters || r >= mech.parameters.size()) continue;
+            for (size_t j = 0; j < width; j++) pp->parameters[r][instances[j]] = src[j];
+        }
+        for (size_t q = 0; q < block->n_ions; q++, src += width) {
+            if (!pp->ion_states || q >= mech.ions.size()) continue;
+            auto & ion = pp->ion_states[q];
+            if (!ion.diffusive_concentration) continue;
+            for (size_t j = 0; j < width; j++) ion.diffusive_concentration[ion.index[instances[j]]] = src[j];
+        }
+    }
 }
-static void write_ions(arb_mechanism_ppack* pp) {
-    int idx = (int)pp->globals[0];
-    mechs.at(idx)->write_ions_handler(PP(pp, mechs.at(idx)));
+
+class Profile {
+    // times one trampoline call from construction to destruction
+    using clock = std::chrono::steady_clock;
+    ArbMech * mech = nullptr;
+    Callback cb;
+    arb_size_type width;
+    clock::time_point start, mark;
+    double gil = 0, view = 0, handler = 0;
+    static double ns(clock::time_point a, clock::time_point b) {
+        return std::chrono::duration<double, std::nano>(b - a).count();
+    }
+public:
+    Profile(ArbMech & mech, Callback cb, arb_mechanism_ppack * pp) : cb(cb), width(pp->width) {
+        if (!profiling.load(std::memory_order_relaxed)) return;
+        this->mech = &mech;
+        start = mark = clock::now();
+    }
+    Profile(const Profile &) = delete;
+    void gil_done() { if (mech) { auto now = clock::now(); gil += ns(mark, now); mark = now; } }
+    void view_done() { if (mech) { auto now = clock::now(); view += ns(mark, now); mark = now; } }
+    void handler_done() { if (mech) { auto now = clock::now(); handler += ns(mark, now); mark = now; } }
+    ~Profile() {
+        if (!mech) return;
+        double total = ns(start, clock::now());
+        std::lock_guard<std::mutex> lock(mech->stats_mutex);
+        auto & st = mech->stats[cb];
+        st.add(total, width);
+        st.gil += gil;
+        st.view += view;
+        st.handler += handler;
+    }
+};
+
+template<typename... Args>
+static py::object call_python(ArbMech & mech, Profile & prof, py::function & handler, arb_mechanism_ppack * pp, bool rebuild, Args&&... args) {
+    auto & view = mech.view(pp, rebuild);
+    if (mech.float32) view.second->to_float32();
+    prof.view_done();
+    auto result = handler(view.first, std::forward<Args>(args)...);
+    prof.handler_done();
+    if (mech.float32) view.second->from_float32();
+    view.second->scatter_local();
+    return result;
 }
-static void apply_events(arb_mechanism_ppack* pp, arb_deliverable_event_stream* stream_ptr) {
-    (void)pp;
-    (void)stream_ptr;
+
+static void run_init(ArbMech * mech, Profile & prof, arb_mechanism_ppack* pp) {
+    if (mech->init_native) return mech->init_native(pp);
+    if (mech->rates.enabled()) return mech->rates.init(pp);
+    py::gil_scoped_acquire gil;
+    prof.gil_done();
+    if (!mech->init_handler) return;
+    // the view was dropped by begin_init, so this builds a fresh one
+    auto result = call_python(*mech, prof, mech->init_handler, pp, true);
+    if (mech->step_handler) mech->view(pp).second->stage(result);
 }
-static void post_event(arb_mechanism_ppack*pp) {
-    (void)pp;
+static void init(ArbMech * mech, arb_mechanism_ppack* pp) {
+    Profile prof(*mech, cb_init, pp);
+    uint64_t round;
+    {
+        std::lock_guard<std::mutex> lock(init_mutex);
+        if (forced_round) {
+            round = forced_round;
+        } else {
+            if (stepped.exchange(false)) init_round += 1;
+            round = init_round;
+        }
+    }
+    {
+        py::gil_scoped_acquire gil;
+        mech->begin_init(pp, round);
+    }
+    if (mech->recorder) mech->recorder->forget(pp);
+    run_init(mech, prof, pp);
+    // warm start: overwrite what init computed, straight from the mapping
+    if (checkpoint) checkpoint->restore(*mech, pp);
+}
+static void run_advance_state(ArbMech * mech, Profile & prof, arb_mechanism_ppack* pp) {
+    if (mech->advance_state_native) return mech->advance_state_native(pp);
+    if (mech->rates.enabled()) return mech->rates.advance_state(pp);
+    if (mech->update_every > 1) {
+        auto view = mech->find_view(pp);
+        if (view && !view->slow_step()) {
+            view->replay_state();
+            view->next_step();
+            return;
+        }
+    }
+    py::gil_scoped_acquire gil;
+    prof.gil_done();
+    PP * sub = nullptr;
+    if (mech->update_every > 1) {
+        sub = mech->view(pp).second;
+        sub->set_dt_scale(mech->update_every);
+        sub->begin_state();
+    }
+    if (mech->step_handler) {
+        auto result = call_python(*mech, prof, mech->step_handler, pp, false);
+        mech->view(pp).second->stage(result);
+    } else if (mech->advance_state_handler) {
+        call_python(*mech, prof, mech->advance_state_handler, pp, false);
+    }
+    if (sub) {
+        sub->set_dt_scale(1);
+        sub->end_state();
+        sub->next_step();
+    }
+}
+static void advance_state(ArbMech * mech, arb_mechanism_ppack* pp) {
+    // read first, so threads don't all write the shared flag every step
+    if (!stepped.load(std::memory_order_relaxed)) stepped.store(true, std::memory_order_relaxed);
+    Profile prof(*mech, cb_advance_state, pp);
+    run_advance_state(mech, prof, pp);
+    if (mech->recorder) mech->recorder->sample(pp);
+}
+static void compute_currents(ArbMech * mech, arb_mechanism_ppack* pp) {
+    Profile prof(*mech, cb_compute_currents, pp);
+    if (mech->compute_currents_native) return mech->compute_currents_native(pp);
+    if (mech->rates.enabled()) return mech->rates.compute_currents(pp);
+    if (mech->step_handler) {
+        if (auto view = mech->find_view(pp)) view->apply_staged_currents();
+        return;
+    }
+    if (mech->caches_currents()) {
+        auto view = mech->find_view(pp);
+        if (view && view->skip_currents()) return view->replay_currents();
+    }
+    py::gil_scoped_acquire gil;
+    prof.gil_done();
+    if (!mech->compute_currents_handler) return;
+    if (mech->caches_currents()) {
+        auto sub = mech->view(pp).second;
+        sub->begin_currents();
+        call_python(*mech, prof, mech->compute_currents_handler, pp, false);
+        sub->end_currents();
+        return;
+    }
+    call_python(*mech, prof, mech->compute_currents_handler, pp, false);
+}
+static void write_ions(ArbMech * mech, arb_mechanism_ppack* pp) {
+    Profile prof(*mech, cb_write_ions, pp);
+    if (mech->write_ions_native) return mech->write_ions_native(pp);
+    if (mech->rates.enabled()) return;
+    if (mech->step_handler) {
+        if (auto view = mech->find_view(pp)) view->apply_staged_ions();
+        return;
+    }
+    if (mech->caches_ions()) {
+        auto view = mech->find_view(pp);
+        if (view && view->skip_ions()) return view->replay_ions();
+    }
+    py::gil_scoped_acquire gil;
+    prof.gil_done();
+    if (!mech->write_ions_handler) return;
+    if (mech->caches_ions()) mech->view(pp).second->begin_ions();
+    call_python(*mech, prof, mech->write_ions_handler, pp, false);
+    if (mech->caches_ions()) mech->view(pp).second->end_ions();
+}
+static void apply_events(ArbMech * mech, arb_mechanism_ppack* pp, arb_deliverable_event_stream* stream_ptr) {
+    // most steps deliver no events
+    if (stream_ptr->begin == stream_ptr->end) return;
+    Profile prof(*mech, cb_apply_events, pp);
+    if (mech->apply_events_native) return mech->apply_events_native(pp, stream_ptr);
+    if (!mech->apply_events_handler) return;
+    py::gil_scoped_acquire gil;
+    prof.gil_done();
+    // zero-copy structured array of (mech_index, weight)
+    py::array_t<arb_deliverable_event_data> events(stream_ptr->end - stream_ptr->begin, stream_ptr->begin, py::none());
+    // pybind11 marks arrays with a base writeable, but this is arbor's const buffer
+    events.attr("setflags")("write"_a = false);
+    call_python(*mech, prof, mech->apply_events_handler, pp, false, events);
+}
+static void post_event(ArbMech * mech, arb_mechanism_ppack*pp) {
+    Profile prof(*mech, cb_post_event, pp);
+    if (mech->post_event_native) return mech->post_event_native(pp);
+    if (!mech->post_event_handler) return;
+    py::gil_scoped_acquire gil;
+    prof.gil_done();
+    call_python(*mech, prof, mech->post_event_handler, pp, false);
 }
 
+// arbor only hands the trampolines a ppack, so every mechanism slot gets its
+// own instantiation that knows which mechanism it serves; no lookup, no
+// hidden global in the ppack. More mechanisms need another Registry
+constexpr size_t max_mechs = 64;
+ArbMech * slots[max_mechs];
+
+template<size_t S>
+struct Slot {
+    static void init(arb_mechanism_ppack* pp) { ::init(slots[S], pp); }
+    static void advance_state(arb_mechanism_ppack* pp) { ::advance_state(slots[S], pp); }
+    static void compute_currents(arb_mechanism_ppack* pp) { ::compute_currents(slots[S], pp); }
+    static void write_ions(arb_mechanism_ppack* pp) { ::write_ions(slots[S], pp); }
+    static void apply_events(arb_mechanism_ppack* pp, arb_deliverable_event_stream* stream_ptr) { ::apply_events(slots[S], pp, stream_ptr); }
+    static void post_event(arb_mechanism_ppack* pp) { ::post_event(slots[S], pp); }
+};
+
+struct Trampolines {
+    arb_mechanism_method init, advance_state, compute_currents, write_ions;
+    arb_mechanism_method_events apply_events;
+    arb_mechanism_method post_event;
+};
+
+template<size_t... S>
+constexpr std::array<Trampolines, sizeof...(S)> make_trampolines(std::index_sequence<S...>) {
+    return {{ {Slot<S>::init, Slot<S>::advance_state, Slot<S>::compute_currents,
+               Slot<S>::write_ions, Slot<S>::apply_events, Slot<S>::post_event}... }};
+}
+constexpr auto trampolines = make_trampolines(std::make_index_sequence<max_mechs>());
+
 arb_mechanism_interface * null_interface() { return nullptr; }
 
+size_t type_counter = 0;
+
 arb_mechanism_interface * make_cpu_iface() {
     frozen_check(true);
-    static arb_mechanism_interface result;
-    result.partition_width = 1;
+    // load_catalogue asks for the interface right after the type, so the
+    // last generated type tells us which mechanism this is for
+    if (type_counter == 0) ERROR("interface requested before mechanism type");
+    auto & mech = mechs.at(type_counter - 1);
+    auto & result = mech->iface;
+    auto & trampoline = trampolines.at(mech->slot);
+    result.partition_width = mech->partition_width;
     result.backend = arb_backend_kind_cpu;
-    result.alignment = 8;
-    result.init_mechanism   = init;
-    result.compute_currents = compute_currents;
-    result.apply_events     = apply_events;
-    result.advance_state    = advance_state;
-    result.write_ions       = write_ions;
-    result.post_event       = post_event;
+    result.alignment = mech->alignment;
+    result.init_mechanism   = trampoline.init;
+    result.compute_currents = trampoline.compute_currents;
+    result.apply_events     = trampoline.apply_events;
+    result.advance_state    = trampoline.advance_state;
+    result.write_ions       = trampoline.write_ions;
+    result.post_event       = trampoline.post_event;
     return &result;
 }
 
 arb_mechanism_type make_input_type() {
     // we writing against load_catalogue in arbor/mechcat.cpp, see top of file
     frozen_check(true);
-    static size_t call_counter = 0;
     // this is ugly, but we know this function is called in a loop
     // so in that way we find out which mechanism we are generating for
-    if (call_counter >= mechs.size()) ERROR("called > size(mechs) times; called load_catalogue twice?");
-    auto & mech = mechs.at(call_counter);
-    call_counter += 1;
+    if (type_counter >= mechs.size()) ERROR("called > size(mechs) times");
+    auto & mech = mechs.at(type_counter);
+    type_counter += 1;
     arb_mechanism_type result;
     result.abi_version = ARB_MECH_ABI_VERSION;
-    result.fingerprint = "<placeholder>";
+    result.fingerprint = mech->fingerprint.c_str();
     result.name = mech->name.c_str();
     result.kind = mech->kind;
     result.is_linear = mech->is_linear;
@@ -382,8 +1778,12 @@ extern "C" [[gnu::visibility("default")]] const void* get_catalogue(int* n) {
     mechanism_template.type = make_input_type,
     mechanism_template.i_cpu = make_cpu_iface,
     mechanism_template.i_gpu = null_interface;
-    for (size_t i = 0; i < mechs.size(); i++) {
-        mechanisms.push_back(mechanism_template);
+    mechanisms.assign(mechs.size(), mechanism_template);
+    // load_catalogue walks the list from the start on every load
+    type_counter = 0;
+    {
+        py::gil_scoped_acquire gil;
+        for (auto & mech : mechs) mech->rates.tabulate();
     }
     *n = mechs.size();
     frozen = true;
@@ -401,20 +1801,134 @@ const char * get_so_name() {
 PYBIND11_MODULE(_core, m) {
     /* pybind entry point */
     m.doc() = "Custom Arbor Mod";
+    // Every registry loads its own copy of this library (see
+    // arbor_pycat.Registry), so classes are module_local and the dtype may
+    // already be known from an earlier copy, with an identical layout
+    try {
+        PYBIND11_NUMPY_DTYPE(arb_deliverable_event_data, mech_index, weight);
+    } catch (const std::runtime_error &) { }
     m.def("get_so_name", []() {
         const char * so_name = get_so_name();
         return std::string(so_name);
         });
 
+    m.def("ppack_offsets", []() {
+        /* byte offsets into arb_mechanism_ppack/arb_ion_state for native kernels */
+        py::dict res;
+#define PPACK_FIELD(x) res[#x] = offsetof(arb_mechanism_ppack, x)
+        PPACK_FIELD(width);
+        PPACK_FIELD(n_detectors);
+        PPACK_FIELD(vec_ci);
+        PPACK_FIELD(dt);
+        PPACK_FIELD(vec_v);
+        PPACK_FIELD(vec_i);
+        PPACK_FIELD(vec_g);
+        PPACK_FIELD(temperature_degC);
+        PPACK_FIELD(diam_um);
+        PPACK_FIELD(area_um2);
+        PPACK_FIELD(time_since_spike);
+        PPACK_FIELD(node_index);
+        PPACK_FIELD(weight);
+        PPACK_FIELD(mechanism_id);
+        PPACK_FIELD(parameters);
+        PPACK_FIELD(state_vars);
+        PPACK_FIELD(globals);
+        PPACK_FIELD(ion_states);
+        PPACK_FIELD(random_numbers);
+#undef PPACK_FIELD
+        res["sizeof_ion_state"] = sizeof(arb_ion_state);
+#define ION_FIELD(x) res["ion_" #x] = offsetof(arb_ion_state, x)
+        ION_FIELD(current_density);
+        ION_FIELD(conductivity);
+        ION_FIELD(reversal_potential);
+        ION_FIELD(internal_concentration);
+        ION_FIELD(external_concentration);
+        ION_FIELD(diffusive_concentration);
+        ION_FIELD(ionic_charge);
+        ION_FIELD(index);
+#undef ION_FIELD
+        return res;
+    });
+    m.def("enable_stats", [](bool enable) { profiling.store(enable, std::memory_order_relaxed); }, py::arg("enable") = true);
+    m.def("reset_stats", []() {
+        for (auto & mech : mechs) {
+            std::lock_guard<std::mutex> lock(mech->stats_mutex);
+            mech->stats = {};
+        }
+    });
+    m.def("stats", []() {
+        // {mechanism: {callback: {...}}}, times in seconds
+        py::dict res;
+        for (auto & mech : mechs) {
+            std::lock_guard<std::mutex> lock(mech->stats_mutex);
+            py::dict per_callback;
+            for (size_t cb = 0; cb < n_callbacks; cb++) {
+                auto & st = mech->stats[cb];
+                if (!st.count) continue;
+                py::dict d;
+                d["count"] = st.count;
+                d["total"] = st.total*1e-9;
+                d["min"] = st.min*1e-9;
+                d["max"] = st.max*1e-9;
+                d["p99"] = st.p99()*1e-9;
+                d["gil"] = st.gil*1e-9;
+                d["view"] = st.view*1e-9;
+                d["handler"] = st.handler*1e-9;
+                d["width"] = (double)st.width/st.count;
+                d["ns_per_cv"] = st.width ? st.total/st.width : 0.;
+                per_callback[callback_names[cb]] = d;
+            }
+            res[mech->name.c_str()] = per_callback;
+        }
+        return res;
+    });
+    m.def("save_checkpoint", [](const std::string & path) {
+        return Checkpoint::save(path);
+    }, py::arg("path"));
+    m.def("load_checkpoint", [](const std::string & path) {
+        checkpoint = std::make_unique<Checkpoint>(path);
+    }, py::arg("path"));
+    m.def("close_checkpoint", []() {
+        if (!checkpoint) return;
+        auto unmatched = checkpoint->unmatched();
+        auto ambiguous = checkpoint->ambiguous();
+        checkpoint.reset();
+        auto warn = [](const std::string & msg) {
+            if (PyErr_WarnEx(PyExc_RuntimeWarning, msg.c_str(), 1) < 0) throw py::error_already_set();
+        };
+        if (unmatched) warn(std::to_string(unmatched) + " checkpointed cells matched no mechanism instance and were not restored");
+        if (ambiguous) warn(std::to_string(ambiguous) + " cells were not restored: other cells have the same CVs and parameters");
+    });
+    // arbor_pycat.simulation: initialise ppacks in their own round, 0 for a
+    // new one, until end_round_init; drop_round forgets them
+    m.def("begin_round_init", [](uint64_t round) {
+        std::lock_guard<std::mutex> lock(init_mutex);
+        if (!round) round = ++init_round;
+        forced_round = round;
+        stepped = false;
+        live_rounds.insert(round);
+        return round;
+    }, py::arg("round") = 0);
+    m.def("end_round_init", []() {
+        std::lock_guard<std::mutex> lock(init_mutex);
+        forced_round = 0;
+    });
+    m.def("drop_round", [](uint64_t round) {
+        {
+            std::lock_guard<std::mutex> lock(init_mutex);
+            live_rounds.erase(round);
+        }
+        for (auto & mech : mechs) mech->drop_round(round);
+    }, py::arg("round"));
     m.def("register", [](std::shared_ptr<ArbMech> & mech) {
         frozen_check();
-        if (mech->globals.at(0).default_value != 123456789.) {
-            ERROR("something went wrong with the global idx");
-        }
-        mech->globals.at(0).default_value = (arb_value_type)mechs.size();
+        if (mech->slot >= 0) ERROR("mechanism registered twice");
+        if (mechs.size() >= max_mechs) ERROR("too many mechanisms, use another arbor_pycat.Registry");
+        mech->slot = mechs.size();
+        slots[mech->slot] = mech.get();
         mechs.push_back(mech);
     });
-    py::class_<ArbMech, std::shared_ptr<ArbMech>>(m, "ArbMech")
+    py::class_<ArbMech, std::shared_ptr<ArbMech>>(m, "ArbMech", py::module_local())
         .def(py::init<>())
         .def("set_name", [](std::shared_ptr<ArbMech> & mech, const std::string & name) {
             mech->name = name;
@@ -465,25 +1979,130 @@ PYBIND11_MODULE(_core, m) {
                 py::arg("verify_valence") = false,
                 py::arg("expected_valence") = 1
                 )
-        .def("set_kind_point", [](std::shared_ptr<ArbMech> & mech) {
+        .def("set_kind_density", [](std::shared_ptr<ArbMech> & mech) {
             frozen_check();
             mech->kind = arb_mechanism_kind_density;
         })
         .def("set_kind_point", [](std::shared_ptr<ArbMech> & mech) {
             frozen_check();
-            mech->kind = arb_mechanism_kind_density;
+            mech->kind = arb_mechanism_kind_point;
+        })
+        .def("set_has_post_events", [](std::shared_ptr<ArbMech> & mech, bool has_post_events) {
+            frozen_check();
+            mech->has_post_events = has_post_events;
+        })
+        .def("set_partition_width", [](std::shared_ptr<ArbMech> & mech, arb_size_type partition_width) {
+            frozen_check();
+            if (partition_width == 0) ERROR("partition_width must be positive");
+            mech->partition_width = partition_width;
+        })
+        .def("start_recording", [](std::shared_ptr<ArbMech> & mech, const std::string & path,
+                    const std::vector<std::pair<std::string, size_t>> & fields,
+                    unsigned stride, std::vector<arb_index_type> cvs, size_t capacity) {
+            static const std::unordered_map<std::string, Recorder::Kind> kinds = {
+                {"state", Recorder::state}, {"v", Recorder::v}, {"i", Recorder::i}, {"g", Recorder::g},
+                {"ion_i", Recorder::ion_i}, {"ion_g", Recorder::ion_g}, {"ion_erev", Recorder::ion_erev},
+                {"ion_xi", Recorder::ion_xi}, {"ion_xo", Recorder::ion_xo}, {"ion_xd", Recorder::ion_xd}};
+            std::vector<Recorder::Field> resolved;
+            for (auto & [kind, index] : fields) {
+                auto it = kinds.find(kind);
+                if (it == kinds.end()) ERROR("unknown field kind, expected state, v, i, g or ion_{i,g,erev,xi,xo,xd}");
+                if (it->second == Recorder::state && index >= mech->state_vars.size()) ERROR("state out of range");
+                if (it->second >= Recorder::ion_i && index >= mech->ions.size()) ERROR("ion out of range");
+                resolved.push_back({it->second, index});
+            }
+            if (mech->recorder) mech->recorder->close();
+            mech->recorder = std::make_shared<Recorder>(path, std::move(resolved), stride, std::move(cvs), capacity);
+        }, py::arg("path"), py::arg("fields"), py::arg("stride") = 1, py::arg("cvs") = std::vector<arb_index_type>(), py::arg("capacity") = 4096)
+        .def("stop_recording", [](std::shared_ptr<ArbMech> & mech) {
+            if (!mech->recorder) return;
+            mech->recorder->close();
+            mech->recorder.reset();
+        })
+        .def("set_fingerprint", [](std::shared_ptr<ArbMech> & mech, const std::string & fingerprint) {
+            frozen_check();
+            mech->fingerprint = fingerprint;
+        })
+        .def("set_float32", [](std::shared_ptr<ArbMech> & mech, bool float32) {
+            frozen_check();
+            mech->float32 = float32;
+        })
+        .def("set_constant", [](std::shared_ptr<ArbMech> & mech, bool compute_currents, bool write_ions) {
+            frozen_check();
+            mech->constant_currents = compute_currents;
+            mech->constant_ions = write_ions;
+        }, py::arg("compute_currents") = false, py::arg("write_ions") = false)
+        .def("mark_dirty", [](std::shared_ptr<ArbMech> & mech) {
+            mech->mark_dirty();
+        })
+        .def("set_update_every", [](std::shared_ptr<ArbMech> & mech, unsigned update_every, bool extrapolate) {
+            frozen_check();
+            if (update_every == 0) ERROR("update_every must be positive");
+            mech->update_every = update_every;
+            mech->extrapolate = extrapolate;
+        }, py::arg("update_every"), py::arg("extrapolate") = false)
+        .def("set_alignment", [](std::shared_ptr<ArbMech> & mech, arb_size_type alignment) {
+            frozen_check();
+            if (alignment < sizeof(arb_value_type) || (alignment & (alignment - 1))) ERROR("alignment must be a power of two of at least 8 bytes");
+            mech->alignment = alignment;
         })
-        .def("set_init", [](std::shared_ptr<ArbMech> & mech, std::function<void(const PP pp)> init_handler) {
+        .def("set_init", [](std::shared_ptr<ArbMech> & mech, py::function init_handler) {
             mech->init_handler = init_handler;
         })
-        .def("set_advance_state", [](std::shared_ptr<ArbMech> & mech, std::function<void(const PP pp)> advance_state_handler) {
+        .def("set_advance_state", [](std::shared_ptr<ArbMech> & mech, py::function advance_state_handler) {
             mech->advance_state_handler = advance_state_handler;
         })
-        .def("set_compute_currents", [](std::shared_ptr<ArbMech> & mech, std::function<void(const PP pp)> compute_currents_handler) {
+        .def("set_compute_currents", [](std::shared_ptr<ArbMech> & mech, py::function compute_currents_handler) {
             mech->compute_currents_handler = compute_currents_handler;
         })
-        .def("set_write_ions", [](std::shared_ptr<ArbMech> & mech, std::function<void(const PP pp)> write_ions_handler) {
+        .def("set_write_ions", [](std::shared_ptr<ArbMech> & mech, py::function write_ions_handler) {
             mech->write_ions_handler = write_ions_handler;
+        })
+        .def("set_rate_range", [](std::shared_ptr<ArbMech> & mech, double vmin, double vmax, size_t n) {
+            frozen_check();
+            mech->rates.vmin = vmin;
+            mech->rates.vmax = vmax;
+            mech->rates.n = n;
+        })
+        .def("add_rate_gate", [](std::shared_ptr<ArbMech> & mech, size_t state, py::function alpha, py::function beta) {
+            frozen_check();
+            if (state >= mech->state_vars.size()) ERROR("rate gate state out of range");
+            mech->rates.gates.push_back({state, alpha, beta, {}, {}});
+        })
+        .def("add_rate_current", [](std::shared_ptr<ArbMech> & mech, size_t gbar, size_t erev, std::vector<std::pair<size_t, int>> powers) {
+            frozen_check();
+            if (gbar >= mech->parameters.size() || erev >= mech->parameters.size()) ERROR("rate current parameter out of range");
+            for (auto & power : powers) {
+                if (power.first >= mech->state_vars.size()) ERROR("rate current state out of range");
+            }
+            mech->rates.currents.push_back({gbar, erev, powers});
+        })
+        .def("set_step", [](std::shared_ptr<ArbMech> & mech, py::function step_handler) {
+            mech->step_handler = step_handler;
+        })
+        .def("set_apply_events", [](std::shared_ptr<ArbMech> & mech, py::function apply_events_handler) {
+            mech->apply_events_handler = apply_events_handler;
+        })
+        .def("set_post_event", [](std::shared_ptr<ArbMech> & mech, py::function post_event_handler) {
+            mech->post_event_handler = post_event_handler;
+        })
+        .def("set_init_native", [](std::shared_ptr<ArbMech> & mech, uintptr_t address) {
+            mech->init_native = (arb_mechanism_method)address;
+        })
+        .def("set_advance_state_native", [](std::shared_ptr<ArbMech> & mech, uintptr_t address) {
+            mech->advance_state_native = (arb_mechanism_method)address;
+        })
+        .def("set_compute_currents_native", [](std::shared_ptr<ArbMech> & mech, uintptr_t address) {
+            mech->compute_currents_native = (arb_mechanism_method)address;
+        })
+        .def("set_write_ions_native", [](std::shared_ptr<ArbMech> & mech, uintptr_t address) {
+            mech->write_ions_native = (arb_mechanism_method)address;
+        })
+        .def("set_apply_events_native", [](std::shared_ptr<ArbMech> & mech, uintptr_t address) {
+            mech->apply_events_native = (arb_mechanism_method_events)address;
+        })
+        .def("set_post_event_native", [](std::shared_ptr<ArbMech> & mech, uintptr_t address) {
+            mech->post_event_native = (arb_mechanism_method)address;
         });
     m.add_object("_cleanup", py::capsule([]() {
         /* prevent segfault */
@@ -493,20 +2112,45 @@ PYBIND11_MODULE(_core, m) {
             mech->advance_state_handler = {};
             mech->compute_currents_handler = {};
             mech->write_ions_handler = {};
+            mech->step_handler = {};
+            mech->apply_events_handler = {};
+            mech->post_event_handler = {};
+            mech->rates.gates.clear();
+            mech->views.clear();
+            mech->ppacks.clear();
+            mech->recorder.reset();
         }
+        checkpoint.reset();
     }));
-    py::class_<PP>(m, "PP")
+    py::class_<PP>(m, "PP", py::module_local())
         .def_property_readonly("width", &PP::get_width)
         .def_property_readonly("nwidth", &PP::get_nwidth)
+        .def_property_readonly("padded_width", &PP::get_padded_width)
         .def_property_readonly("dt", &PP::get_dt)
         .def_property_readonly("node_index", &PP::node_index)
         .def("state", &PP::state)
         .def("get_state", &PP::get_state)
         .def("set_state", &PP::set_state)
+        .def("set_state_from_dlpack", &PP::set_state_from_dlpack)
+        .def_property_readonly("states", &PP::states)
+        .def_property_readonly("params", &PP::params)
+        .def("dlpack", &PP::dlarray)
         .def("get_diff_ions", &PP::get_diff_ions)
         .def("set_diff_ions", &PP::set_diff_ions)
+        .def("gather_ions", &PP::gather_ions)
+        .def("scatter_ions", &PP::scatter_ions, py::arg("field"), py::arg("val"), py::arg("accumulate") = false)
         .def("glob", &PP::glob)
+        .def("mark_dirty", &PP::mark_dirty)
         .def("param", &PP::param)
+        .def("state_padded", &PP::state_padded)
+        .def_property_readonly("v32", &PP::v32)
+        .def_property_readonly("i32", &PP::i32)
+        .def_property_readonly("g32", &PP::g32)
+        .def_property_readonly("states32", &PP::states32)
+        .def_property_readonly("params32", &PP::params32)
+        .def("state32", &PP::state32)
+        .def("param32", &PP::param32)
+        .def("param_padded", &PP::param_padded)
         .def("random", &PP::random)
         .def_property_readonly("v", &PP::v)
         .def_property_readonly("i", &PP::i)
@@ -514,26 +2158,43 @@ PYBIND11_MODULE(_core, m) {
         .def_property_readonly("t_degC", &PP::t_degC)
         .def_property_readonly("diam_um", &PP::diam_um)
         .def_property_readonly("area_um2", &PP::area_um2)
-        .def("ions", &PP::ions)
+        .def_property_readonly("v_local", &PP::v_local)
+        .def_property_readonly("i_local", &PP::i_local)
+        .def_property_readonly("g_local", &PP::g_local)
+        .def_property_readonly("node_layout", &PP::node_layout)
+        .def_property_readonly("weight", &PP::weight)
+        .def_property_readonly("cell_index", &PP::cell_index)
+        .def_property_readonly("n_cells", &PP::get_n_cells)
+        .def_property_readonly("n_detectors", &PP::n_detectors)
+        .def_property_readonly("time_since_spike", &PP::time_since_spike)
+        .def("ions", &PP::ions, py::return_value_policy::reference_internal)
         ;
-    py::class_<ArbPPArray<arb_index_type>>(m, "ArborPPIndexArray", py::buffer_protocol())
+    py::class_<ArbPPArray<arb_index_type>>(m, "ArborPPIndexArray", py::buffer_protocol(), py::module_local())
         .def_buffer([](ArbPPArray<arb_index_type> & p) {
             return py::buffer_info(p.raw, p.size, p.ro);
         });
-    py::class_<ArbPPArray<arb_value_type>>(m, "ArborPPDoubleArray", py::buffer_protocol())
+    py::class_<ArbPPArray<arb_value_type>>(m, "ArborPPDoubleArray", py::buffer_protocol(), py::module_local())
         .def_buffer([](ArbPPArray<arb_value_type> & p) {
             return py::buffer_info(p.raw, p.size, p.ro);
         });
-    py::class_<ArbIonState>(m, "ArbIonState")
-        .def_property_readonly("current_density", [](ArbIonState & s) { return ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->current_density).to_numpy(); })
-        .def_property_readonly("conductivity", [](ArbIonState & s) { return ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->conductivity).to_numpy(); })
-        .def_property_readonly("reversal_potential", [](ArbIonState & s) { return ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->reversal_potential).to_numpy(); })
-        .def_property_readonly("internal_concentration", [](ArbIonState & s) { return ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->internal_concentration).to_numpy(); })
-        .def_property_readonly("external_concentration", [](ArbIonState & s) { return ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->external_concentration).to_numpy(); })
-        .def_property_readonly("diffusive_concentration", [](ArbIonState & s) { return ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->diffusive_concentration).to_numpy(); })
-        .def_property_readonly("ionic_charge", [](ArbIonState & s) { return ArbPPArray<arb_value_type>(s.size_of_data_arrays, s.raw->ionic_charge).to_numpy(); })
-        .def_property_readonly("index", [](ArbIonState & s) { return ArbPPArray<arb_index_type>(s.size_of_index_array, s.raw->index).to_numpy(); })
+    py::class_<ArbDLArray>(m, "ArbDLArray", py::module_local())
+        .def("__dlpack__", [](ArbDLArray & a, py::args, py::kwargs) { return a.to_dlpack(); })
+        .def("__dlpack_device__", [](ArbDLArray &) { return py::make_tuple(kDLCPU, 0); })
+        .def_property_readonly("shape", [](ArbDLArray & a) { return a.shape; })
+        .def("numpy", &ArbDLArray::to_numpy)
+        ;
+    py::class_<ArbIonState>(m, "ArbIonState", py::module_local())
+        .def_property_readonly("current_density", [](ArbIonState & s) { return s.data(s.current_density, s.raw->current_density); })
+        .def_property_readonly("conductivity", [](ArbIonState & s) { return s.data(s.conductivity, s.raw->conductivity); })
+        .def_property_readonly("reversal_potential", [](ArbIonState & s) { return s.data(s.reversal_potential, s.raw->reversal_potential); })
+        .def_property_readonly("internal_concentration", [](ArbIonState & s) { return s.data(s.internal_concentration, s.raw->internal_concentration); })
+        .def_property_readonly("external_concentration", [](ArbIonState & s) { return s.data(s.external_concentration, s.raw->external_concentration); })
+        .def_property_readonly("diffusive_concentration", [](ArbIonState & s) { return s.data(s.diffusive_concentration, s.raw->diffusive_concentration); })
+        .def_property_readonly("ionic_charge", [](ArbIonState & s) { return s.data(s.ionic_charge, s.raw->ionic_charge); })
+        .def_property_readonly("index", [](ArbIonState & s) { return cached_view(s.index, s.size_of_index_array, s.raw->index); })
         ;
+    // mechanism ABI compiled against, part of the codegen cache key
+    m.attr("abi_version") = (long long)ARB_MECH_ABI_VERSION;
 #ifdef VERSION_INFO
 #define STRINGIFY(x) #x
 #define MACRO_STRINGIFY(x) STRINGIFY(x)
@@ -4,7 +4,7 @@ import subprocess
 
 d = os.path.dirname(__file__)
 
-# we can only register -> build once per process so need to spawn multiple python processes
+# the default registry can only register -> build once per process so need to spawn multiple python processes
 
 def test_rand():
     subprocess.check_call([sys.executable, os.path.join(d, 'rand.py')])
@@ -18,4 +18,54 @@ def test_full():
 def test_multi():
     subprocess.check_call([sys.executable, os.path.join(d, 'multi.py')])
 
+def test_native():
+    subprocess.check_call([sys.executable, os.path.join(d, 'native.py')])
 
+def test_fused():
+    subprocess.check_call([sys.executable, os.path.join(d, 'fused.py')])
+
+def test_lut():
+    subprocess.check_call([sys.executable, os.path.join(d, 'lut.py')])
+
+def test_events():
+    subprocess.check_call([sys.executable, os.path.join(d, 'events.py')])
+
+def test_local():
+    subprocess.check_call([sys.executable, os.path.join(d, 'local.py')])
+
+
+def test_stats():
+    subprocess.check_call([sys.executable, os.path.join(d, 'stats.py')])
+
+def test_ions():
+    subprocess.check_call([sys.executable, os.path.join(d, 'ions.py')])
+
+def test_subcycle():
+    subprocess.check_call([sys.executable, os.path.join(d, 'subcycle.py')])
+
+def test_checkpoint():
+    subprocess.check_call([sys.executable, os.path.join(d, 'checkpoint.py')])
+
+def test_record():
+    subprocess.check_call([sys.executable, os.path.join(d, 'record.py')])
+
+def test_float32():
+    subprocess.check_call([sys.executable, os.path.join(d, 'float32.py')])
+
+def test_codegen():
+    subprocess.check_call([sys.executable, os.path.join(d, 'codegen.py')])
+
+def test_registry():
+    subprocess.check_call([sys.executable, os.path.join(d, 'registry.py')])
+
+def test_constant():
+    subprocess.check_call([sys.executable, os.path.join(d, 'constant.py')])
+
+def test_batch():
+    subprocess.check_call([sys.executable, os.path.join(d, 'batch.py')])
+
+def test_dlpack():
+    subprocess.check_call([sys.executable, os.path.join(d, 'dlpack.py')])
+
+def test_padded():
+    subprocess.check_call([sys.executable, os.path.join(d, 'padded.py')])
@@ -0,0 +1,65 @@
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+calls = {'compute_currents': 0}
+widths = []
+
+@arbor_pycat.register
+class Passive(arbor_pycat.CustomMechanism):
+    name = 'passive'
+    parameters = [('gid', '()', -1)]
+    def compute_currents(self, pp):
+        calls['compute_currents'] += 1
+        widths.append((pp.width, pp.n_cells))
+        pp.i_local += (pp.v_local - pp.gid) * 1e-2
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+class network_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 16
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid):
+        decor = arbor.decor().set_property(Vm=2*mV).paint('(tag 1)', arbor.density('passive', dict(gid=1e-10 + gid)))
+        return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def probes(self, _): return [arbor.cable_probe_membrane_voltage('(root)')]
+    def global_properties(self, kind): return self.the_props
+
+def run(batched):
+    calls['compute_currents'] = 0
+    widths.clear()
+    recipe = network_recipe()
+    ctx = arbor.context(threads=2)
+    if batched:
+        sim = arbor.simulation(recipe, ctx, arbor_pycat.batched_decomposition(recipe, ctx))
+    else:
+        sim = arbor.simulation(recipe, ctx)
+    handles = [sim.sample((i, 0), arbor.regular_schedule(0.1)) for i in range(recipe.num_cells())]
+    sim.run(tfinal=30, dt=0.025)
+    v = np.array([sim.samples(handle)[0][0][:, 1] for handle in handles]).T
+    return calls['compute_currents'], v
+
+steps = 30 / 0.025
+per_cell_calls, v_per_cell = run(False)
+batched_calls, v_batched = run(True)
+print(per_cell_calls, batched_calls, set(widths))
+
+# one call per cell group (one per thread) and step, instead of one per cell
+assert abs(per_cell_calls - 16 * steps) <= 16 * 2
+assert abs(batched_calls - 2 * steps) <= 2 * 2
+assert set(widths) == {(8, 8)}
+assert np.allclose(v_batched, v_per_cell)
+assert all(np.round(v_batched[-1], 1) == np.arange(16))
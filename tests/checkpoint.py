@@ -0,0 +1,136 @@
+import os
+import tempfile
+import warnings
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+@arbor_pycat.register
+class Clock(arbor_pycat.CustomMechanism):
+    name = 'clock'
+    state_vars = [('t', 'ms', 0.)]
+    parameters = [('rate', '()', 1.)]
+    def advance_state(self, pp):
+        pp.t += pp.rate * pp.dt
+    def compute_currents(self, pp):
+        pp.i_local += (pp.v_local - 5) * 1e-1
+
+cat = arbor_pycat.build()
+core = arbor_pycat._core
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('(tag 1)', arbor.density("clock"))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def probes(self, _): return [arbor.cable_probe_density_state('(root)', 'clock', 't')]
+    def global_properties(self, kind): return self.the_props
+
+def run(tfinal):
+    sim = arbor_pycat.simulation(single_recipe())
+    handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+    sim.run(tfinal=tfinal, dt=0.025)
+    return sim, sim.samples(handle)[0][0][:, 1]
+
+def warns(fn, text):
+    with warnings.catch_warnings(record=True) as caught:
+        warnings.simplefilter('always')
+        fn()
+    return any(issubclass(w.category, RuntimeWarning) and text in str(w.message) for w in caught)
+
+path = os.path.join(tempfile.mkdtemp(), 'clock.ckpt')
+
+# a simulation that is gone: its instances must not end up in the checkpoint
+old, t = run(7)
+del old
+try:
+    core.save_checkpoint(path)
+    assert False, 'nothing alive to save'
+except RuntimeError:
+    pass
+
+warm, t = run(10)
+assert core.save_checkpoint(path) == 1
+
+core.load_checkpoint(path)
+sim, t = run(5)
+core.close_checkpoint()
+print(t[0], t[-1])
+# restored clock continues from 10 ms instead of 0
+assert abs(t[-1] - 15) < 0.2
+del warm, sim
+
+# cells are matched one by one, so a checkpoint survives regrouping them
+class network_recipe(arbor.recipe):
+    def __init__(self, rates):
+        arbor.recipe.__init__(self)
+        self.rates = rates
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return len(self.rates)
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid):
+        # same morphology everywhere, only the parameter tells cells apart
+        decor = arbor.decor().set_property(Vm=-40*mV).paint('(tag 1)', arbor.density('clock', dict(rate=self.rates[gid])))
+        return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def probes(self, _): return [arbor.cable_probe_density_state('(root)', 'clock', 't')]
+    def global_properties(self, kind): return self.the_props
+
+def run_network(rates, tfinal, batched):
+    recipe = network_recipe(rates)
+    ctx = arbor.context(threads=2)
+    if batched:
+        sim = arbor_pycat.simulation(recipe, ctx, arbor_pycat.batched_decomposition(recipe, ctx))
+    else:
+        sim = arbor_pycat.simulation(recipe, ctx)
+    handles = [sim.sample((gid, 0), arbor.regular_schedule(0.1)) for gid in range(len(rates))]
+    sim.run(tfinal=tfinal, dt=0.025)
+    return sim, np.array([sim.samples(handle)[0][0][-1, 1] for handle in handles])
+
+rates = 1 + np.arange(4)
+warm, t = run_network(rates, 10, batched=False)
+assert core.save_checkpoint(path) == 4
+del warm
+
+core.load_checkpoint(path)
+sim, t = run_network(rates, 5, batched=True)
+core.close_checkpoint()
+print(t)
+# every clock continues from its own cell's 10 ms, at its own rate
+assert np.allclose(t, 15 * rates, atol=0.2 * 4)
+del sim
+
+# saved cells the new simulation does not have are reported
+core.load_checkpoint(path)
+sim, t = run_network(rates[:2], 5, batched=True)
+assert warns(core.close_checkpoint, '2 checkpointed cells')
+assert np.allclose(t, 15 * rates[:2], atol=0.2 * 2)
+del sim
+
+# identical cells can not be told apart: they start from init, with a warning
+same = np.ones(3)
+warm, t = run_network(same, 10, batched=False)
+assert core.save_checkpoint(path) == 3
+del warm
+core.load_checkpoint(path)
+sim, t = run_network(same, 5, batched=True)
+assert warns(core.close_checkpoint, '3 cells were not restored')
+assert np.allclose(t, 5, atol=0.2)
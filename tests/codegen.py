@@ -0,0 +1,90 @@
+import os
+import tempfile
+import warnings
+import numpy as np
+import arbor
+import arbor_pycat
+from arbor_pycat import codegen
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+os.environ.setdefault('ARBOR_PYCAT_CACHE', tempfile.mkdtemp())
+
+g_l = 1e-3
+V_l = -50.
+
+class Leak:
+    state = 'h',
+    @staticmethod
+    def init(v):
+        return np.stack([1 / (1 + np.exp((v + 60)/5.8))])
+    @staticmethod
+    def compute_current(v, state):
+        h, = state
+        return g_l * (1 + h**2) * (v - V_l)
+    @staticmethod
+    def state_gradient(v, state):
+        h, = state
+        h_inf = 1 / (1 + np.exp((v + 60)/5.8))
+        return np.stack([np.where(v > -55, (h_inf - h) / 2, (h_inf - h) / 3)])
+
+class Branchy(Leak):
+    @staticmethod
+    def compute_current(v, state):
+        # python control flow on v can not be traced
+        return g_l * (v - V_l) if v[0] > 0 else g_l * (v - V_l)
+
+class Clamped(Leak):
+    @staticmethod
+    def state_gradient(v, state):
+        h, = state
+        return np.stack([np.where(v == -60, 0, np.where(v != -70, h, -h))])
+
+# equality builds expressions too, instead of comparing the tracers
+source = codegen.generate(Clamped)
+assert '== -60.0' in source and '!= -70.0' in source
+assert 'false ?' not in source and 'true ?' not in source
+
+codegen.register(Leak, 'leak_native')
+codegen.register(Leak, 'leak_python', native=False)
+codegen.register(Branchy, 'leak_branchy')
+with warnings.catch_warnings(record=True) as caught:
+    warnings.simplefilter('always')
+    cat = arbor_pycat.build()
+assert codegen.is_native('leak_native')
+assert not codegen.is_native('leak_python')
+assert not codegen.is_native('leak_branchy')
+assert any('leak_branchy' in str(w.message) for w in caught)
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+class single_recipe(arbor.recipe):
+    def __init__(self, mech):
+        arbor.recipe.__init__(self)
+        self.mech = mech
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid):
+        decor = arbor.decor().set_property(Vm=-70*mV).paint('(tag 1)', arbor.density(self.mech))
+        return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def probes(self, _): return [arbor.cable_probe_membrane_voltage('(root)')]
+    def global_properties(self, kind): return self.the_props
+
+def run(mech):
+    sim = arbor.simulation(single_recipe(mech))
+    handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+    sim.run(tfinal=50, dt=0.025)
+    return sim.samples(handle)[0][0][:, 1]
+
+v_native = run('leak_native')
+v_python = run('leak_python')
+print(v_native[-1], v_python[-1])
+assert abs(v_native[-1] - V_l) < 1
+assert np.max(np.abs(v_native - v_python)) < 1e-9
@@ -0,0 +1,89 @@
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+calls = {'compute_currents': 0, 'write_ions': 0}
+level = {'I': 0.5}
+
+@arbor_pycat.register
+class Inject(arbor_pycat.CustomMechanism):
+    name = 'inject'
+    constant = ('compute_currents', 'write_ions')
+    ions = [arbor_pycat.IonInfo('ca', write_int_concentration=True)]
+    def compute_currents(self, pp):
+        calls['compute_currents'] += 1
+        pp.i_local -= level['I'] * 1e-1
+    def write_ions(self, pp):
+        calls['write_ions'] += 1
+        pp.cai[pp.index_ca] = level['I']
+
+@arbor_pycat.register
+class Leak(arbor_pycat.CustomMechanism):
+    name = 'leak'
+    def compute_currents(self, pp):
+        pp.i_local += pp.v_local * 1e-1
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('(tag 1)', arbor.density("inject"))
+    .paint('(tag 1)', arbor.density("leak"))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def probes(self, _): return [
+            arbor.cable_probe_membrane_voltage('(root)'),
+            arbor.cable_probe_ion_int_concentration('(root)', 'ca'),
+            ]
+    def global_properties(self, kind): return self.the_props
+
+sim = arbor.simulation(single_recipe())
+v_handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+cai_handle = sim.sample((0, 1), arbor.regular_schedule(0.1))
+
+# python runs once, after that the recorded outputs are reapplied natively
+sim.run(tfinal=30, dt=0.025)
+v = sim.samples(v_handle)[0][0][:, 1]
+cai = sim.samples(cai_handle)[0][0][:, 1]
+print(calls, v[-1], cai[-1])
+assert calls == {'compute_currents': 1, 'write_ions': 1}
+assert abs(v[-1] - 0.5) < 1e-3
+assert abs(cai[-1] - 0.5) < 1e-9
+
+# new outputs after marking dirty
+level['I'] = 2
+arbor_pycat.mark_dirty('inject')
+sim.run(tfinal=60, dt=0.025)
+v = sim.samples(v_handle)[0][0][:, 1]
+cai = sim.samples(cai_handle)[0][0][:, 1]
+print(calls, v[-1], cai[-1])
+assert calls == {'compute_currents': 2, 'write_ions': 2}
+assert abs(v[-1] - 2) < 1e-3
+assert abs(cai[-1] - 2) < 1e-9
+
+# a second simulation does not disturb the first one's recorded outputs
+other = arbor.simulation(single_recipe())
+other.run(tfinal=30, dt=0.025)
+assert calls == {'compute_currents': 3, 'write_ions': 3}
+sim.run(tfinal=90, dt=0.025)
+v = sim.samples(v_handle)[0][0][:, 1]
+print(calls, v[-1])
+assert calls == {'compute_currents': 3, 'write_ions': 3}
+assert abs(v[-1] - 2) < 1e-3
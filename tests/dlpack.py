@@ -0,0 +1,111 @@
+import traceback
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+results = {}
+
+def check(pp):
+    # pp is the low level PP, with 2 states x, y and one parameter p
+    n = pp.width
+    x = np.from_dlpack(pp.dlpack('state'))
+    assert x.shape == (2, n) and x.dtype == np.float64
+    # zero-copy: writes through the view are seen by get_state and state()
+    x[0] = np.arange(n)
+    x[1] = -np.arange(n)
+    assert np.array_equal(pp.get_state(), np.stack([np.arange(n), -np.arange(n)]))
+    assert np.array_equal(pp.state(1), -np.arange(n))
+    assert np.array_equal(np.from_dlpack(pp.dlpack('param'))[0], pp.param(0))
+    assert np.array_equal(np.from_dlpack(pp.dlpack('node_index')), pp.node_index)
+    assert np.array_equal(np.from_dlpack(pp.dlpack('v')), pp.v)
+    assert np.array_equal(pp.states, x)
+
+    # the state view itself: rows already in place, nothing is copied
+    x += 1
+    pp.set_state_from_dlpack(x)
+    assert np.array_equal(pp.state(0), np.arange(n) + 1)
+    pp.set_state_from_dlpack(pp.dlpack('state'))
+    assert np.array_equal(pp.state(1), -np.arange(n) + 1)
+
+    # float64, float32 and strided tensors
+    want = np.stack([np.arange(n) * 2., np.arange(n) * 3.])
+    pp.set_state_from_dlpack(want.copy())
+    assert np.array_equal(pp.get_state(), want)
+    pp.set_state_from_dlpack(want.astype(np.float32) + 1)
+    assert np.array_equal(pp.get_state(), want + 1)
+    wide = np.zeros((2, 2*n))
+    wide[:, ::2] = want + 2
+    pp.set_state_from_dlpack(wide[:, ::2])
+    assert np.array_equal(pp.get_state(), want + 2)
+    for bad in [np.zeros((2, n), dtype=np.int64), np.zeros((3, n)), np.zeros((2, n + 1))]:
+        try:
+            pp.set_state_from_dlpack(bad)
+            assert False, f'accepted {bad.dtype} {bad.shape}'
+        except RuntimeError:
+            pass
+
+    # get_state/set_state are C order [n_state, width] copies
+    got = pp.get_state()
+    assert got.flags.c_contiguous and got.shape == (2, n)
+    got[:] = 0
+    assert np.array_equal(pp.get_state(), want + 2)
+    pp.set_state(want + 3)
+    assert np.array_equal(pp.get_state(), want + 3)
+    pp.set_state(np.asfortranarray(want + 4))
+    assert np.array_equal(pp.get_state(), want + 4)
+    pp.set_state((want + 5)[:1]) # leading rows only
+    assert np.array_equal(pp.get_state(), np.stack([want[0] + 5, want[1] + 4]))
+    for bad in [np.zeros((3, n)), np.zeros((2, n + 1)), np.zeros(n)]:
+        try:
+            pp.set_state(bad)
+            assert False, f'accepted shape {bad.shape}'
+        except RuntimeError:
+            pass
+
+@arbor_pycat.register
+class Tensor(arbor_pycat.CustomMechanism):
+    name = 'tensor'
+    state_vars = [('x', '', 0.), ('y', '', 0.)]
+    parameters = [('p', '', 7.)]
+    def advance_state(self, pp):
+        if results:
+            return
+        try:
+            check(pp.pp)
+            results['ok'] = pp.width
+        except Exception:
+            results['error'] = traceback.format_exc()
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('(tag 1)', arbor.density("tensor"))
+    .discretization(arbor.cv_policy_fixed_per_branch(5))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def global_properties(self, kind): return self.the_props
+
+sim = arbor.simulation(single_recipe())
+sim.run(tfinal=0.1, dt=0.025)
+print(results)
+assert 'error' not in results, results['error']
+assert results['ok'] == 5
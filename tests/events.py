@@ -0,0 +1,70 @@
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+    ms = U.ms
+except ImportError:
+    mV = ms = 1
+
+calls = {'events': 0, 'post': 0, 'post_seen': False}
+
+@arbor_pycat.register
+class PySyn(arbor_pycat.CustomMechanism):
+    name = 'pysyn'
+    kind = 'point'
+    has_post_events = True
+    state_vars = [('gsyn', '', 0.)]
+    parameters = [('tau', 'ms', 2.), ('e', 'mV', 0.)]
+    def advance_state(self, pp):
+        pp.gsyn *= np.exp(-pp.dt / pp.tau)
+    def compute_currents(self, pp):
+        np.add.at(pp.i, pp.node_index, pp.gsyn * (pp.v[pp.node_index] - pp.e))
+    def apply_events(self, pp, events):
+        calls['events'] += 1
+        assert not events.flags.writeable
+        np.add.at(pp.gsyn, events['mech_index'], events['weight'])
+    def post_event(self, pp):
+        calls['post'] += 1
+        calls['post_seen'] |= bool(np.any(pp.time_since_spike >= 0))
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+labels = arbor.label_dict({"soma": "(tag 1)", "midpoint": "(location 0 0.5)"})
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-65*mV)
+    .place('"midpoint"', arbor.synapse('pysyn'), 'syn')
+    .place('"midpoint"', arbor.threshold_detector(-10*mV), 'det')
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, labels)
+    def event_generators(self, gid): return [arbor.event_generator('syn', 0.005, arbor.explicit_schedule([10*ms]))]
+    def probes(self, _): return [arbor.cable_probe_membrane_voltage('(root)'),]
+    def global_properties(self, kind): return self.the_props
+recipe = single_recipe()
+sim = arbor.simulation(recipe)
+handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+sim.run(tfinal=30)
+data, meta = sim.samples(handle)[0]
+t = data[:, 0]
+v = data[:, 1]
+print(calls, v[t < 10].min(), v[t < 10].max(), v.max())
+
+assert calls['events'] == 1
+assert np.all(np.abs(v[t < 10] + 65) < 1e-6)
+assert v.max() > -10
+assert calls['post'] > 0 and calls['post_seen']
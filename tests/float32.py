@@ -0,0 +1,99 @@
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+    ms = U.ms
+    nA = U.nA
+except ImportError:
+    mV = ms = nA = 1
+
+def exprelr(x): return np.where(np.isclose(x, 0), 1., x / np.expm1(x))
+def alpha_m(v): return exprelr(-(v + 40) / 10)
+def beta_m(v):  return 4 * np.exp(-(v + 65) / 18)
+def alpha_h(v): return 0.07 * np.exp(-(v + 65) / 20)
+def beta_h(v):  return 1 / (np.exp(-(v + 35) / 10) + 1)
+def alpha_n(v): return 0.1 * exprelr(-(v + 55) / 10)
+def beta_n(v):  return 0.125 * np.exp(-(v + 65) / 80)
+
+class HH(arbor_pycat.CustomMechanism):
+    state_vars = [('m', '', 0.), ('h', '', 0.), ('n', '', 0.)]
+    parameters = [('gnabar', 'S/cm2', 0.12),
+                  ('gkbar',  'S/cm2', 0.036),
+                  ('gl',     'S/cm2', 0.0003),
+                  ('ena',    'mV',    50),
+                  ('ek',     'mV',   -77),
+                  ('el',     'mV',   -54.3)]
+    def init_mechanism(self, pp):
+        v = pp.v_local
+        pp.m = alpha_m(v) / (alpha_m(v) + beta_m(v))
+        pp.h = alpha_h(v) / (alpha_h(v) + beta_h(v))
+        pp.n = alpha_n(v) / (alpha_n(v) + beta_n(v))
+    def advance_state(self, pp):
+        v = pp.v_local
+        for x, a, b in ((pp.m, alpha_m(v), beta_m(v)),
+                        (pp.h, alpha_h(v), beta_h(v)),
+                        (pp.n, alpha_n(v), beta_n(v))):
+            inf = a / (a + b)
+            x[:] = inf + (x - inf) * np.exp(-pp.dt * (a + b))
+    def compute_currents(self, pp):
+        v = pp.v_local
+        gna = pp.gnabar * pp.m**3 * pp.h
+        gk = pp.gkbar * pp.n**4
+        pp.i_local += 10 * (gna*(v - pp.ena) + gk*(v - pp.ek) + pp.gl*(v - pp.el))
+        pp.g_local += 10 * (gna + gk + pp.gl)
+
+@arbor_pycat.register
+class HH64(HH):
+    name = 'hh64'
+
+@arbor_pycat.register
+class HH32(HH):
+    name = 'hh32'
+    float32 = True
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+labels = arbor.label_dict({"soma": "(tag 1)", "midpoint": "(location 0 0.5)"})
+
+class single_recipe(arbor.recipe):
+    def __init__(self, mech):
+        arbor.recipe.__init__(self)
+        self.mech = mech
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid):
+        decor = (
+            arbor.decor()
+            .set_property(Vm=-65*mV)
+            .paint('"soma"', arbor.density(self.mech))
+            .place('"midpoint"', arbor.iclamp(10*ms, 80*ms, 0.1*nA), 'iclamp')
+        )
+        return arbor.cable_cell(tree, decor, labels)
+    def probes(self, _): return [arbor.cable_probe_membrane_voltage('(root)'),]
+    def global_properties(self, kind): return self.the_props
+
+def run(mech):
+    sim = arbor.simulation(single_recipe(mech))
+    handle = sim.sample((0, 0), arbor.regular_schedule(0.025))
+    sim.run(tfinal=100, dt=0.025)
+    data, meta = sim.samples(handle)[0]
+    return data[:, 0], data[:, 1]
+
+t, v64 = run('hh64')
+_, v32 = run('hh32')
+up64 = t[1:][(v64[:-1] < 0) & (v64[1:] >= 0)]
+up32 = t[1:][(v32[:-1] < 0) & (v32[1:] >= 0)]
+print('spikes', up64, up32)
+print('max |dv| before first spike', np.max(np.abs(v64 - v32)[t < up64[0] - 1]))
+assert len(up64) > 0
+assert len(up64) == len(up32)
+# drift: spike times stay within a few steps of the double run
+assert np.max(np.abs(up64 - up32)) < 0.1
+assert np.max(np.abs(v64 - v32)[t < up64[0] - 1]) < 1e-2
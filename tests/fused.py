@@ -0,0 +1,61 @@
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+@arbor_pycat.register
+class FusedPassive(arbor_pycat.CustomMechanism):
+    name = 'fused_passive'
+    fused = True
+    state_vars = [('t', 'ms', 0.)]
+    def compute_currents(self, pp):
+        raise RuntimeError('fused mode should not call compute_currents')
+    def step(self, pp):
+        v = pp.v[pp.node_index]
+        return {
+            'state': np.stack([pp.t + pp.dt]),
+            'i': (v - 5) * 1e-1,
+        }
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+labels = arbor.label_dict({"soma": "(tag 1)", "midpoint": "(location 0 0.5)"})
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('"soma"', arbor.density("fused_passive"))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, labels)
+    def probes(self, _): return [
+            arbor.cable_probe_membrane_voltage('(root)'),
+            arbor.cable_probe_density_state('(root)', 'fused_passive', 't'),
+            ]
+    def global_properties(self, kind): return self.the_props
+recipe = single_recipe()
+sim = arbor.simulation(recipe)
+handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+t_handle = sim.sample((0, 1), arbor.regular_schedule(0.1))
+sim.run(tfinal=30, dt=0.025)
+data, meta = sim.samples(handle)[0]
+v = data[:, 1]
+t = sim.samples(t_handle)[0][0][:, 1]
+print(v[-1], t[-1])
+assert abs(v[-1] - 5) < 1e-3
+assert abs(t[-1] - 30) < 0.2
@@ -0,0 +1,62 @@
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+@arbor_pycat.register
+class BatchIons(arbor_pycat.CustomMechanism):
+    name = 'batch_ions'
+    state_vars = [('c', 'mM', 0.)]
+    ions = [arbor_pycat.IonInfo('ca', write_int_concentration=True),
+            arbor_pycat.IonInfo('k', write_int_concentration=True)]
+    def init_mechanism(self, pp):
+        pp.c = pp.gather_ions('xi')[0]
+    def advance_state(self, pp):
+        pp.c += pp.dt * 1e-4
+    def write_ions(self, pp):
+        xi = pp.gather_ions('xi')
+        assert xi.shape == (2, pp.width)
+        xi[0] = pp.c
+        pp.scatter_ions('xi', xi)
+        # accumulate leaves arbor's own currents in place
+        pp.scatter_ions('i', np.zeros((2, pp.width)), accumulate=True)
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-65*mV)
+    .paint('(tag 1)', arbor.density("batch_ions"))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def probes(self, _): return [
+            arbor.cable_probe_ion_int_concentration('(root)', 'ca'),
+            arbor.cable_probe_density_state('(root)', 'batch_ions', 'c'),
+            ]
+    def global_properties(self, kind): return self.the_props
+
+sim = arbor.simulation(single_recipe())
+cai_handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+c_handle = sim.sample((0, 1), arbor.regular_schedule(0.1))
+sim.run(tfinal=10, dt=0.025)
+cai = sim.samples(cai_handle)[0][0][:, 1]
+c = sim.samples(c_handle)[0][0][:, 1]
+print(cai[-1], c[-1])
+assert c[-1] > c[0]
+assert abs(cai[-1] - c[-1]) < 1e-6
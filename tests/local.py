@@ -0,0 +1,67 @@
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+    Ohm_cm = U.Ohm * U.cm
+except ImportError:
+    mV = 1
+    Ohm_cm = 1
+
+layouts = set()
+
+@arbor_pycat.register
+class LocalPassive(arbor_pycat.CustomMechanism):
+    name = 'local_passive'
+    def compute_currents(self, pp):
+        layouts.add(('density', pp.pp.node_layout))
+        pp.i_local += (pp.v_local - 5) * 1e-1
+
+@arbor_pycat.register
+class LocalPoint(arbor_pycat.CustomMechanism):
+    name = 'local_point'
+    kind = 'point'
+    def compute_currents(self, pp):
+        layouts.add(('point', pp.pp.node_layout))
+        pp.i_local += (pp.v_local - 5) * 5e-2
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=2)
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=2)
+
+labels = arbor.label_dict({"soma": "(tag 1)", "dend": "(tag 2)", "midpoint": "(location 0 0.5)"})
+
+# two synapses on the same CV give a node_index with duplicates
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV, rL=1e5*Ohm_cm)
+    .paint('"dend"', arbor.density("local_passive"))
+    .place('"midpoint"', arbor.synapse("local_point"), 'syn0')
+    .place('"midpoint"', arbor.synapse("local_point"), 'syn1')
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, labels)
+    def probes(self, _): return [arbor.cable_probe_membrane_voltage('"midpoint"'),]
+    def global_properties(self, kind): return self.the_props
+recipe = single_recipe()
+sim = arbor.simulation(recipe)
+handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+sim.run(tfinal=30)
+data, meta = sim.samples(handle)[0]
+v = data[:, 1]
+print(layouts, v[-1])
+
+assert ('point', 'general') in layouts
+assert abs(v[-1] - 5) < 1e-3
@@ -0,0 +1,75 @@
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+    ms = U.ms
+    nA = U.nA
+except ImportError:
+    mV = ms = nA = 1
+
+def exprelr(x): return np.where(np.isclose(x, 0), 1., x / np.expm1(x))
+def alpha_m(v): return exprelr(-(v + 40) / 10)
+def beta_m(v):  return 4 * np.exp(-(v + 65) / 18)
+def alpha_h(v): return 0.07 * np.exp(-(v + 65) / 20)
+def beta_h(v):  return 1 / (np.exp(-(v + 35) / 10) + 1)
+def alpha_n(v): return 0.1 * exprelr(-(v + 55) / 10)
+def beta_n(v):  return 0.125 * np.exp(-(v + 65) / 80)
+
+@arbor_pycat.register
+class LutHH(arbor_pycat.RateMechanism):
+    name = 'lut_hh'
+    parameters = [('gnabar', 'S/cm2', 0.12),
+                  ('gkbar',  'S/cm2', 0.036),
+                  ('gl',     'S/cm2', 0.0003),
+                  ('ena',    'mV',    50),
+                  ('ek',     'mV',   -77),
+                  ('el',     'mV',   -54.3)]
+    gates = [arbor_pycat.Gate('m', alpha_m, beta_m),
+             arbor_pycat.Gate('h', alpha_h, beta_h),
+             arbor_pycat.Gate('n', alpha_n, beta_n)]
+    currents = [arbor_pycat.Current('gnabar', 'ena', {'m': 3, 'h': 1}),
+                arbor_pycat.Current('gkbar', 'ek', {'n': 4}),
+                arbor_pycat.Current('gl', 'el')]
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+labels = arbor.label_dict({"soma": "(tag 1)", "midpoint": "(location 0 0.5)"})
+
+class single_recipe(arbor.recipe):
+    def __init__(self, mech):
+        arbor.recipe.__init__(self)
+        self.mech = mech
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid):
+        decor = (
+            arbor.decor()
+            .set_property(Vm=-65*mV)
+            .paint('"soma"', arbor.density(self.mech))
+            .place('"midpoint"', arbor.iclamp(10*ms, 80*ms, 0.1*nA), 'iclamp')
+        )
+        return arbor.cable_cell(tree, decor, labels)
+    def probes(self, _): return [arbor.cable_probe_membrane_voltage('(root)'),]
+    def global_properties(self, kind): return self.the_props
+
+def run(mech):
+    sim = arbor.simulation(single_recipe(mech))
+    handle = sim.sample((0, 0), arbor.regular_schedule(0.025))
+    sim.run(tfinal=100, dt=0.025)
+    data, meta = sim.samples(handle)[0]
+    v = data[:, 1]
+    return np.sum((v[:-1] < 0) & (v[1:] >= 0))
+
+spikes_lut = run('lut_hh')
+spikes_builtin = run('hh')
+print(spikes_lut, spikes_builtin)
+assert spikes_builtin > 0
+assert spikes_lut == spikes_builtin
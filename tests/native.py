@@ -0,0 +1,85 @@
+import ctypes
+import numpy as np
+import arbor
+import arbor_pycat
+import arbor_pycat._core as acm
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+OFF = acm.ppack_offsets()
+KERNEL = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+
+def field(pp, name, ctype):
+    return ctype.from_address(pp + OFF[name]).value
+
+def array(pp, name, ctype, n):
+    ptr = ctypes.cast(field(pp, name, ctypes.c_void_p), ctypes.POINTER(ctype))
+    return np.ctypeslib.as_array(ptr, (n,))
+
+# ctypes still takes the GIL, but goes through the exact same native path
+# as a numba cfunc or a symbol from a shared library would
+@KERNEL
+def compute_currents(pp):
+    width = field(pp, 'width', ctypes.c_uint32)
+    node_index = array(pp, 'node_index', ctypes.c_int, width)
+    nwidth = node_index.max() + 1
+    v = array(pp, 'vec_v', ctypes.c_double, nwidth)
+    i = array(pp, 'vec_i', ctypes.c_double, nwidth)
+    i[node_index] += (v[node_index] - 5) * 1e-1
+
+@arbor_pycat.register
+class NativePassive(arbor_pycat.CustomMechanism):
+    name = 'native_passive'
+    native = {'compute_currents': compute_currents}
+    def compute_currents(self, pp):
+        raise RuntimeError('python path should not be called')
+
+# a native kernel next to python callbacks that assign state
+@arbor_pycat.register
+class NativeClock(arbor_pycat.CustomMechanism):
+    name = 'native_clock'
+    state_vars = [('t', 'ms', 0.)]
+    native = {'compute_currents': compute_currents}
+    def advance_state(self, pp):
+        pp.t = pp.t + pp.dt
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+labels = arbor.label_dict({"soma": "(tag 1)", "midpoint": "(location 0 0.5)"})
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('"soma"', arbor.density("native_passive"))
+    .paint('"soma"', arbor.density("native_clock"))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, labels)
+    def probes(self, _): return [arbor.cable_probe_membrane_voltage('(root)'),
+                                 arbor.cable_probe_density_state('(root)', 'native_clock', 't')]
+    def global_properties(self, kind): return self.the_props
+recipe = single_recipe()
+sim = arbor.simulation(recipe)
+handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+clock = sim.sample((0, 1), arbor.regular_schedule(0.1))
+sim.run(tfinal=30)
+data, meta = sim.samples(handle)[0]
+v = data[:, 1]
+t = sim.samples(clock)[0][0][:, 1]
+print(v[-1], t[-1])
+assert abs(v[-1] - 5) < 1e-3
+assert abs(t[-1] - 30) < 0.2
@@ -0,0 +1,69 @@
+import traceback
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+results = {}
+
+@arbor_pycat.register
+class Padded(arbor_pycat.CustomMechanism):
+    name = 'padded'
+    partition_width = 8
+    alignment = 64
+    state_vars = [('x', '', 1.), ('y', '', 2.)]
+    parameters = [('p', '', 3.), ('q', '', 4.)]
+    def advance_state(self, pp):
+        if results:
+            return
+        try:
+            n, padded = pp.width, pp.padded_width
+            assert padded >= n
+            for rows in [[pp.pp.state(0), pp.pp.state(1)], [pp.pp.param(0), pp.pp.param(1)]]:
+                # padded_width is arbor's spacing between rows
+                assert rows[1].ctypes.data - rows[0].ctypes.data == padded * 8
+            for name, value in [('x', 1.), ('y', 2.), ('p', 3.), ('q', 4.)]:
+                row, block = getattr(pp, name), getattr(pp, f'{name}_padded')
+                assert block.shape == (padded,)
+                assert block.ctypes.data == row.ctypes.data
+                assert np.all(block[:n] == value)
+            # writes to the padded block land in the row, scratch is ignored
+            pp.x_padded[:] = 5
+            assert np.all(pp.x == 5)
+            assert np.all(pp.y == 2)
+            results['ok'] = (n, padded)
+        except Exception:
+            results['error'] = traceback.format_exc()
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('(tag 1)', arbor.density("padded"))
+    .discretization(arbor.cv_policy_fixed_per_branch(5))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def global_properties(self, kind): return self.the_props
+
+sim = arbor.simulation(single_recipe())
+sim.run(tfinal=0.1, dt=0.025)
+print(results)
+assert 'error' not in results, results['error']
+assert results['ok'][0] == 5
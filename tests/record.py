@@ -0,0 +1,91 @@
+import os
+import tempfile
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+@arbor_pycat.register
+class RecClock(arbor_pycat.CustomMechanism):
+    name = 'rec_clock'
+    state_vars = [('t', 'ms', 0.)]
+    def advance_state(self, pp):
+        pp.t += pp.dt
+    def compute_currents(self, pp):
+        pp.i_local += (pp.v_local - 5) * 1e-1
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('(tag 1)', arbor.density("rec_clock"))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def global_properties(self, kind): return self.the_props
+
+path = os.path.join(tempfile.mkdtemp(), 'clock.rec')
+rec = arbor_pycat.record('rec_clock', ['t', 'v'], path, every=4, capacity=16)
+sim = arbor.simulation(single_recipe())
+sim.run(tfinal=10, dt=0.025)
+rec.stop()
+
+data, = rec.read().values()
+print(data.shape, data[-1])
+steps, t, v = data[:, 0], data[:, 1], data[:, 2]
+assert abs(len(steps) - 100) <= 1
+assert np.all(np.diff(steps) == 4)
+assert np.allclose(t, (steps + 1) * 0.025)
+assert abs(v[-1] - 5) < 1e-2
+
+# two cells in one group: the header frame tells which instance each column is
+class pair_recipe(single_recipe):
+    def num_cells(self): return 2
+
+path = os.path.join(tempfile.mkdtemp(), 'pair.rec')
+rec = arbor_pycat.record('rec_clock', ['t', 'v'], path, cvs=[1])
+recipe = pair_recipe()
+ctx = arbor.context(threads=1)
+sim = arbor.simulation(recipe, ctx, arbor_pycat.batched_decomposition(recipe, ctx))
+sim.run(tfinal=1, dt=0.025)
+rec.stop()
+
+data, = rec.read().values()
+layout, = rec.layout().values()
+print(data.shape, layout)
+# cvs are local to the group: CV 1 is the second cell's only CV
+assert data.shape[1] == 1 + 2 * 1
+assert list(layout['cv']) == [1] and list(layout['cell']) == [1]
+
+# every (re)initialised ppack starts a stream of its own, with its own header
+path = os.path.join(tempfile.mkdtemp(), 'two.rec')
+rec = arbor_pycat.record('rec_clock', ['t'], path)
+sim = arbor.simulation(recipe, ctx, arbor_pycat.batched_decomposition(recipe, ctx))
+sim.run(tfinal=1, dt=0.025)
+del sim
+sim = arbor.simulation(single_recipe())
+sim.run(tfinal=1, dt=0.025)
+rec.stop()
+
+data = rec.read()
+layout = rec.layout()
+print({stream: d.shape for stream, d in data.items()})
+assert sorted(data) == sorted(layout) == [0, 1]
+assert [len(layout[stream]) for stream in (0, 1)] == [2, 1]
+assert [data[stream].shape[1] for stream in (0, 1)] == [3, 2]
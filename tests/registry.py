@@ -0,0 +1,62 @@
+import numpy as np
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+def variant(E):
+    # same mechanism name in every registry, only the reversal potential differs
+    class Passive(arbor_pycat.CustomMechanism):
+        name = 'passive'
+        def compute_currents(self, pp):
+            pp.i_local += (pp.v_local - E) * 1e-2
+    return Passive
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+class single_recipe(arbor.recipe):
+    def __init__(self, cat):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid):
+        decor = arbor.decor().set_property(Vm=0*mV).paint('(tag 1)', arbor.density('passive'))
+        return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def probes(self, _): return [arbor.cable_probe_membrane_voltage('(root)')]
+    def global_properties(self, kind): return self.the_props
+
+def run(cat):
+    sim = arbor.simulation(single_recipe(cat))
+    handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+    sim.run(tfinal=30)
+    return sim.samples(handle)[0][0][-1, 1]
+
+# the default registry and two independent ones, built and run one after the other
+arbor_pycat.register(variant(-10))
+results = {-10: run(arbor_pycat.build())}
+for E in [20, 40]:
+    registry = arbor_pycat.Registry()
+    registry.register(variant(E))
+    results[E] = run(registry.build())
+
+# a built registry is frozen, new ones are not
+try:
+    arbor_pycat.register(variant(0))
+    assert False, 'registered after build'
+except RuntimeError:
+    pass
+
+# loading the same catalogue again gives the same mechanisms
+results[-10, 'again'] = run(arbor_pycat.build())
+
+print(results)
+for E, v in results.items():
+    E = E[0] if isinstance(E, tuple) else E
+    assert abs(v - E) < 0.5, (E, v)
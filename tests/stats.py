@@ -0,0 +1,55 @@
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+@arbor_pycat.register
+class StatsPassive(arbor_pycat.CustomMechanism):
+    name = 'stats_passive'
+    def compute_currents(self, pp):
+        pp.i_local += (pp.v_local - 5) * 1e-1
+
+cat = arbor_pycat.build()
+core = arbor_pycat._core
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('(tag 1)', arbor.density("stats_passive"))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def global_properties(self, kind): return self.the_props
+
+sim = arbor.simulation(single_recipe())
+sim.run(tfinal=1, dt=0.025)
+assert core.stats()['stats_passive'] == {}
+
+core.enable_stats()
+sim.run(tfinal=2, dt=0.025)
+core.enable_stats(False)
+stats = core.stats()['stats_passive']
+print(stats)
+cc = stats['compute_currents']
+assert abs(cc['count'] - 40) <= 1
+assert cc['min'] <= cc['p99'] <= cc['max']
+assert cc['view'] + cc['handler'] <= cc['total']
+assert cc['width'] >= 1
+assert 'advance_state' in stats # trampoline runs, no handler
+
+core.reset_stats()
+assert core.stats()['stats_passive'] == {}
@@ -0,0 +1,79 @@
+import arbor
+import arbor_pycat
+
+try:
+    from arbor import units as U
+    mV = U.mV
+except ImportError:
+    mV = 1
+
+calls = {'compute_currents': 0, 'advance_state': 0, 'write_ions': 0}
+
+@arbor_pycat.register
+class SlowPassive(arbor_pycat.CustomMechanism):
+    name = 'slow_passive'
+    update_every = 4
+    extrapolate = True
+    state_vars = [('t', 'ms', 0.)]
+    def advance_state(self, pp):
+        calls['advance_state'] += 1
+        pp.t += pp.dt
+    def compute_currents(self, pp):
+        calls['compute_currents'] += 1
+        pp.i_local += (pp.v_local - 5) * 1e-1
+
+@arbor_pycat.register
+class SlowCa(arbor_pycat.CustomMechanism):
+    name = 'slow_ca'
+    update_every = 4
+    ions = [arbor_pycat.IonInfo('ca', write_int_concentration=True)]
+    def write_ions(self, pp):
+        calls['write_ions'] += 1
+        pp.cai[pp.index_ca] = 0.5
+
+cat = arbor_pycat.build()
+
+tree = arbor.segment_tree()
+tree.append(arbor.mnpos, arbor.mpoint(-3, 0, 0, 3), arbor.mpoint(3, 0, 0, 3), tag=1)
+
+decor = (
+    arbor.decor()
+    .set_property(Vm=-40*mV)
+    .paint('(tag 1)', arbor.density("slow_passive"))
+    .paint('(tag 1)', arbor.density("slow_ca"))
+)
+
+class single_recipe(arbor.recipe):
+    def __init__(self):
+        arbor.recipe.__init__(self)
+        self.the_props = arbor.neuron_cable_properties()
+        self.the_props.catalogue.extend(cat, '')
+    def num_cells(self): return 1
+    def cell_kind(self, _): return arbor.cell_kind.cable
+    def cell_description(self, gid): return arbor.cable_cell(tree, decor, arbor.label_dict())
+    def probes(self, _): return [
+            arbor.cable_probe_membrane_voltage('(root)'),
+            arbor.cable_probe_density_state('(root)', 'slow_passive', 't'),
+            arbor.cable_probe_ion_int_concentration('(root)', 'ca'),
+            ]
+    def global_properties(self, kind): return self.the_props
+
+sim = arbor.simulation(single_recipe())
+v_handle = sim.sample((0, 0), arbor.regular_schedule(0.1))
+t_handle = sim.sample((0, 1), arbor.regular_schedule(0.1))
+cai_handle = sim.sample((0, 2), arbor.regular_schedule(0.1))
+sim.run(tfinal=30, dt=0.025)
+v = sim.samples(v_handle)[0][0][:, 1]
+t = sim.samples(t_handle)[0][0][:, 1]
+cai = sim.samples(cai_handle)[0][0][:, 1]
+print(calls, v[-1], t[-1])
+steps = 30 / 0.025
+assert abs(calls['compute_currents'] - steps / 4) <= 2
+assert abs(calls['advance_state'] - steps / 4) <= 2
+assert abs(v[-1] - 5) < 1e-3
+# extrapolated state tracks time between python calls
+assert abs(t[-1] - 30) < 0.2
+# ion writes are replayed from the first python call, never from an empty record
+assert abs(calls['write_ions'] - steps / 4) <= 2
+assert (cai != 0).all()
+assert (cai[1:] == 0.5).all(), cai[cai != 0.5]